@@ -0,0 +1,146 @@
+#include "caustics.hpp"
+#include "ray.hpp"
+#include "world.hpp"
+#include "tiles.hpp"
+#include <cmath>
+#include <vector>
+
+using std::vector;
+
+//map texels per block along x and z
+#define CAUSTIC_RES 4
+#define CAUSTIC_W (chunksX * 16 * CAUSTIC_RES)
+#define CAUSTIC_H (chunksZ * 16 * CAUSTIC_RES)
+//distance (along the refracted sun direction) a point may be past the
+//texel's occluder and still count as lit
+#define CAUSTIC_BIAS 0.05f
+//depth of texels with no open water at the surface
+#define NOT_WATER -1.0f
+
+//distance from the surface to the first occluder along waterSun
+//(0 if sunlight doesn't reach the surface there)
+static vector<float> depthMap;
+//density of sun rays that land around the texel's occluder,
+//relative to a flat surface
+static vector<float> lightMap;
+//sunlight direction below a flat surface
+static vec3 waterSun;
+static bool mapValid = false;
+
+//how far a ray going down from the surface at s travels before it's blocked
+static float occluderDistance(vec3 s)
+{
+  vec3 pos = s;
+  float travelled = 0;
+  //up to a few transparent crossings (air pockets, glass, leaves)
+  for(int i = 0; i < 8; i++)
+  {
+    ivec3 block;
+    vec3 normal;
+    Block prevMat, nextMat;
+    bool escape = false;
+    vec3 hit = collideRay(pos, waterSun, block, normal, prevMat, nextMat, escape);
+    if(escape)
+      break;
+    travelled += glm::length(hit - pos);
+    if(!isTransparent(nextMat))
+      return travelled;
+    if((nextMat == GLASS || nextMat == LEAF) && opaqueTexel(nextMat, faceSide(normal), hit.x, hit.y, hit.z))
+      return travelled;
+    pos = hit;
+  }
+  //nothing in the way down to the bottom of the world
+  return s.y / -waterSun.y;
+}
+
+void buildCausticMap()
+{
+  const float n = materials[WATER].ior;
+  waterSun = normalize(glm::refract(sunlight, vec3(0, 1, 0), 1 / n));
+  depthMap.assign(CAUSTIC_W * CAUSTIC_H, NOT_WATER);
+  lightMap.assign(CAUSTIC_W * CAUSTIC_H, 0);
+  //where each texel's refracted ray lands, moved back along waterSun to
+  //the surface (NAN if no light gets in there)
+  vector<vec2> landing(CAUSTIC_W * CAUSTIC_H);
+  parallelFor(CAUSTIC_H, [&](int row)
+  {
+    for(int col = 0; col < CAUSTIC_W; col++)
+    {
+      int t = col + row * CAUSTIC_W;
+      landing[t] = vec2(NAN, NAN);
+      vec3 s((col + 0.5f) / CAUSTIC_RES, seaLevel, (row + 0.5f) / CAUSTIC_RES);
+      int bx = col / CAUSTIC_RES;
+      int bz = row / CAUSTIC_RES;
+      if(getBlockFast(bx, seaLevel - 1, bz) != WATER)
+        continue;
+      if(!isTransparent(getBlockFast(bx, seaLevel, bz)) || !visibleFromSun(s, vec3(0, 1, 0), true))
+      {
+        depthMap[t] = 0;
+        continue;
+      }
+      float depth = occluderDistance(s);
+      depthMap[t] = depth;
+      //a wave refracts the ray a little off waterSun, so it lands beside
+      //the point it would reach under a flat surface
+      float h = depth * -waterSun.y;
+      vec3 bent = normalize(glm::refract(sunlight, waterNormal(s), 1 / n));
+      vec3 offset = bent * (h / -bent.y) - waterSun * depth;
+      landing[t] = vec2(s.x + offset.x, s.z + offset.z);
+    }
+  });
+  //splat one photon per texel (bilinear), so a flat surface gives 1 everywhere
+  for(int t = 0; t < CAUSTIC_W * CAUSTIC_H; t++)
+  {
+    vec2 l = landing[t];
+    if(std::isnan(l.x))
+      continue;
+    float u = l.x * CAUSTIC_RES - 0.5f;
+    float v = l.y * CAUSTIC_RES - 0.5f;
+    int c = (int) floorf(u);
+    int r = (int) floorf(v);
+    float fu = u - c;
+    float fv = v - r;
+    float w[4] = {(1 - fu) * (1 - fv), fu * (1 - fv), (1 - fu) * fv, fu * fv};
+    for(int k = 0; k < 4; k++)
+    {
+      int cc = c + k % 2;
+      int rr = r + k / 2;
+      if(cc >= 0 && rr >= 0 && cc < CAUSTIC_W && rr < CAUSTIC_H)
+        lightMap[cc + rr * CAUSTIC_W] += w[k];
+    }
+  }
+  mapValid = true;
+}
+
+bool causticLight(vec3 pos, float& light)
+{
+  if(!mapValid || pos.y >= seaLevel)
+    return false;
+  //follow the sun ray through pos back up to the surface
+  float dist = (seaLevel - pos.y) / -waterSun.y;
+  vec3 s = pos - waterSun * dist;
+  float u = s.x * CAUSTIC_RES - 0.5f;
+  float v = s.z * CAUSTIC_RES - 0.5f;
+  int c = (int) floorf(u);
+  int r = (int) floorf(v);
+  if(c < 0 || r < 0 || c + 1 >= CAUSTIC_W || r + 1 >= CAUSTIC_H)
+    return false;
+  float fu = u - c;
+  float fv = v - r;
+  float w[4] = {(1 - fu) * (1 - fv), fu * (1 - fv), (1 - fu) * fv, fu * fv};
+  //lit if any of the 4 texels' rays gets as far as pos: at the edge of a
+  //step, the nearest texel's ray may hit the side of the step instead
+  float reach = 0;
+  light = 0;
+  for(int k = 0; k < 4; k++)
+  {
+    int t = (c + k % 2) + (r + k / 2) * CAUSTIC_W;
+    if(depthMap[t] == NOT_WATER)
+      return false;
+    reach = fmax(reach, depthMap[t]);
+    light += w[k] * lightMap[t];
+  }
+  if(dist > reach + CAUSTIC_BIAS)
+    light = 0;
+  return true;
+}
@@ -0,0 +1,21 @@
+#ifndef CAUSTICS_H
+#define CAUSTICS_H
+
+#include "glmHeaders.hpp"
+
+//Sun light below the sea surface, for fancy renders.
+//Once per frame, rays from the sun are refracted through the sea surface
+//(using waterNormal) and followed to the first thing they hit underwater.
+//This gives two maps over the surface: how far each refracted sun ray
+//travels before it is blocked (a shadow map along the refracted sun
+//direction), and how densely the perturbed rays land around it (caustics).
+
+//Rebuild the maps for the current world, sun and water (render() calls
+//this at the start of every fancy frame)
+void buildCausticMap();
+//Sun light reaching pos, an underwater point: 0 in shadow, 1 under a flat
+//surface, more or less where the waves focus or spread the light.
+//Returns false if the maps don't cover pos (the caller has to trace it).
+bool causticLight(vec3 pos, float& light);
+
+#endif
@@ -0,0 +1,178 @@
+#include "checkerboard.hpp"
+#include "player.hpp"
+#include <cmath>
+#include <vector>
+
+using std::vector;
+
+//order in which CHECKERBOARD 4 traces the corners of each 2x2 block
+//(alternating diagonals, so any two frames in a row cover it evenly)
+static const int quarterOrder[4] = {0, 3, 1, 2};
+//opposite neighbour pairs (dx, dy, dx, dy) a missing pixel can average
+static const int pairs[4][4] =
+{
+  {-1, 0, 1, 0},
+  {0, -1, 0, 1},
+  {-1, -1, 1, 1},
+  {-1, 1, 1, -1}
+};
+//surfaces closer than this (see surfaceDistance) are the same surface
+#define SAME_SURFACE 0.1f
+
+static vector<PixelSurface> surfaces;
+//the last frame's colors, with the traced or predicted surface of every pixel
+static vector<PixelSurface> last;
+static mat4 lastViewProj;
+static bool haveLast = false;
+static int lastWorldVersion;
+static unsigned frame = 0;
+
+PixelSurface* beginCheckerFrame()
+{
+  size_t n = RAY_W * RAY_H;
+  if(surfaces.size() != n)
+  {
+    surfaces.resize(n);
+    last.resize(n);
+    haveLast = false;
+  }
+  frame++;
+  return &surfaces[0];
+}
+
+static bool tracedIn(unsigned f, int x, int y)
+{
+  if(CHECKERBOARD >= 4)
+    return ((x & 1) | (y & 1) << 1) == quarterOrder[f & 3];
+  return ((x + y + f) & 1) == 0;
+}
+
+bool checkerTraced(int x, int y)
+{
+  return tracedIn(frame, x, y);
+}
+
+//0 for points on the same plane, growing with the difference in depth
+//and normal, plus a penalty for different materials
+static float surfaceDistance(const PixelSurface& a, const PixelSurface& b)
+{
+  if((a.material == AIR) != (b.material == AIR))
+    return INFINITY;
+  if(a.material == AIR)
+    return 0;
+  float d = fabsf(a.depth - b.depth) / fmin(a.depth, b.depth) + (1 - glm::dot(a.normal, b.normal));
+  return a.material == b.material ? d : d + 1;
+}
+
+//Predict pixel (x, y) from its traced neighbours
+static void interpolate(int x, int y, PixelSurface& out)
+{
+  float best = INFINITY;
+  int ia = -1;
+  int ib = -1;
+  for(int k = 0; k < 4; k++)
+  {
+    int ax = x + pairs[k][0];
+    int ay = y + pairs[k][1];
+    int bx = x + pairs[k][2];
+    int by = y + pairs[k][3];
+    bool aIn = ax >= 0 && ay >= 0 && ax < RAY_W && ay < RAY_H && checkerTraced(ax, ay);
+    bool bIn = bx >= 0 && by >= 0 && bx < RAY_W && by < RAY_H && checkerTraced(bx, by);
+    if(aIn && bIn)
+    {
+      float d = surfaceDistance(surfaces[ax + ay * RAY_W], surfaces[bx + by * RAY_W]);
+      if(ia < 0 || d < best)
+      {
+        best = d;
+        ia = ax + ay * RAY_W;
+        ib = bx + by * RAY_W;
+      }
+    }
+    else if(ia < 0 && (aIn || bIn))
+    {
+      //at the edge of the image: only one side is there
+      ia = ib = aIn ? ax + ay * RAY_W : bx + by * RAY_W;
+    }
+  }
+  if(ia < 0)
+  {
+    out.color = vec3(0, 0, 0);
+    out.material = AIR;
+    return;
+  }
+  const PixelSurface& a = surfaces[ia];
+  const PixelSurface& b = surfaces[ib];
+  out.color = (a.color + b.color) * 0.5f;
+  if(best < SAME_SURFACE)
+  {
+    out.pos = (a.pos + b.pos) * 0.5f;
+    out.normal = a.normal;
+    out.material = a.material;
+    out.depth = (a.depth + b.depth) * 0.5f;
+  }
+  else
+  {
+    //on an edge: the pixel's surface is one of the two, guess the nearer
+    const PixelSurface& nearer = a.depth < b.depth ? a : b;
+    out.pos = nearer.pos;
+    out.normal = nearer.normal;
+    out.material = nearer.material;
+    out.depth = nearer.depth;
+  }
+}
+
+//Find a pixel traced in the last frame whose surface is now seen through
+//pixel p (whose predicted surface is out). Returns true and sets out to
+//it if there is one.
+static bool reuseLast(int p, const mat4& viewProj, PixelSurface& out)
+{
+  int q = pixelAt(lastViewProj, vec4(out.pos, 1));
+  if(q < 0)
+    return false;
+  int qx = q % RAY_W;
+  int qy = q / RAY_W;
+  //the surface seen through p is in front of (or on) the predicted one,
+  //unless the pixel is on an edge, where it may be either neighbour
+  float maxDepth = out.depth * 1.05f + 0.05f;
+  for(int k = 0; k < 5; k++)
+  {
+    int x = qx + (k == 1) - (k == 2);
+    int y = qy + (k == 3) - (k == 4);
+    //only reuse colors that were traced, so errors don't build up
+    if(x < 0 || y < 0 || x >= RAY_W || y >= RAY_H || !tracedIn(frame - 1, x, y))
+      continue;
+    const PixelSurface& prev = last[x + y * RAY_W];
+    if(prev.material == AIR || pixelAt(viewProj, vec4(prev.pos, 1)) != p ||
+        glm::length(prev.pos - player) > maxDepth)
+      continue;
+    out = prev;
+    return true;
+  }
+  return false;
+}
+
+void reconstructCheckerboard()
+{
+  //shading only changes when blocks do, so colors of the last frame are
+  //good until then
+  bool useLast = haveLast && worldVersion() == lastWorldVersion;
+  mat4 viewProj = proj * view;
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      PixelSurface& surface = surfaces[x + y * RAY_W];
+      if(!checkerTraced(x, y))
+      {
+        interpolate(x, y, surface);
+        if(useLast && surface.material != AIR)
+          reuseLast(x + y * RAY_W, viewProj, surface);
+      }
+      storePixel(x, y, surface.color);
+    }
+  });
+  surfaces.swap(last);
+  lastViewProj = viewProj;
+  lastWorldVersion = worldVersion();
+  haveLast = true;
+}
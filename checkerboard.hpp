@@ -0,0 +1,24 @@
+#ifndef CHECKERBOARD_H
+#define CHECKERBOARD_H
+
+#include "ray.hpp"
+
+//Sparse fast frames. With CHECKERBOARD 2, each frame traces every second
+//pixel in a checkerboard that alternates between frames; with 4, every
+//fourth pixel (one corner of each 2x2 block, cycling through all four).
+//A pixel that isn't traced first averages the pair of opposite traced
+//neighbours whose depth, normal and material agree best, so edges stay
+//sharp. If the surface of a pixel traced in the previous frame now
+//projects into the missing pixel (and isn't behind the predicted surface),
+//that traced color is used instead, which keeps detail thinner than a
+//pixel when the view is still. Sky is always interpolated.
+
+//Size the buffers and advance the pattern for a new frame, and return the
+//surfaces for renderPixel to fill in (RAY_W * RAY_H, row major)
+PixelSurface* beginCheckerFrame();
+//Is pixel (x, y) traced in the current frame?
+bool checkerTraced(int x, int y);
+//Fill in the pixels that weren't traced, and store the frame (storePixel)
+void reconstructCheckerboard();
+
+#endif
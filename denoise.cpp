@@ -0,0 +1,190 @@
+#include "denoise.hpp"
+#include "ray.hpp"
+#include "player.hpp"
+#include <cmath>
+#include <algorithm>
+
+//Number of a-trous iterations: the 5x5 kernel's taps are spaced
+//1, 2, 4, ... pixels apart, so the footprint doubles each time
+#define DENOISE_ITERATIONS 5
+
+//Edge-stopping strengths (same roles as in SVGF)
+//luminance: how many standard deviations of difference are tolerated
+const float sigmaLuminance = 4;
+//normal: weight is dot(n_p, n_q)^normalPower
+const float normalPower = 128;
+//depth: difference tolerated relative to the local depth gradient
+const float sigmaDepth = 1;
+
+void FeatureBuffers::resize(int n)
+{
+  albedo.assign(n, vec3(1, 1, 1));
+  normal.assign(n, vec3(0, 0, 0));
+  depth.assign(n, INFINITY);
+  material.assign(n, AIR);
+}
+
+static inline float luminance(vec3 c)
+{
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+//keep demodulation well defined on black texels
+static inline vec3 safeAlbedo(vec3 a)
+{
+  return glm::max(a, vec3(0.01f, 0.01f, 0.01f));
+}
+
+void denoise(vector<vec3>& color, const vector<float>& variance, const FeatureBuffers& f)
+{
+  const int w = RAY_W;
+  const int h = RAY_H;
+  const int n = w * h;
+  vector<vec3> irradiance(n);
+  vector<vec3> nextIrradiance(n);
+  vector<float> var(n);
+  vector<float> nextVar(n);
+  vector<float> blurredVar(n);
+  //screen-space depth gradient, so depth weights follow slanted surfaces
+  vector<float> depthGrad(n);
+  parallelFor(h, [&](int y)
+  {
+    for(int x = 0; x < w; x++)
+    {
+      int p = x + y * w;
+      vec3 albedo = safeAlbedo(f.albedo[p]);
+      float la = luminance(albedo);
+      irradiance[p] = color[p] / albedo;
+      var[p] = variance[p] / (la * la);
+      float gx = 0;
+      float gy = 0;
+      if(x > 0 && x < w - 1 && f.material[p - 1] != AIR && f.material[p + 1] != AIR)
+        gx = fabsf(f.depth[p + 1] - f.depth[p - 1]) / 2;
+      if(y > 0 && y < h - 1 && f.material[p - w] != AIR && f.material[p + w] != AIR)
+        gy = fabsf(f.depth[p + w] - f.depth[p - w]) / 2;
+      depthGrad[p] = fmax(gx, gy);
+    }
+  });
+  //B3 spline kernel weights for offsets 0, 1, 2
+  const float kernel[3] = {3.0f / 8, 1.0f / 4, 1.0f / 16};
+  for(int iter = 0; iter < DENOISE_ITERATIONS; iter++)
+  {
+    const int step = 1 << iter;
+    //the luminance weight uses a slightly blurred variance, since
+    //per-pixel estimates are noisy themselves
+    parallelFor(h, [&](int y)
+    {
+      for(int x = 0; x < w; x++)
+      {
+        float sum = 0;
+        int count = 0;
+        for(int qy = std::max(y - 1, 0); qy <= std::min(y + 1, h - 1); qy++)
+        {
+          for(int qx = std::max(x - 1, 0); qx <= std::min(x + 1, w - 1); qx++)
+          {
+            sum += var[qx + qy * w];
+            count++;
+          }
+        }
+        blurredVar[x + y * w] = sum / count;
+      }
+    });
+    parallelFor(h, [&](int y)
+    {
+      for(int x = 0; x < w; x++)
+      {
+        int p = x + y * w;
+        Block mat = f.material[p];
+        if(mat == AIR)
+        {
+          nextIrradiance[p] = irradiance[p];
+          nextVar[p] = var[p];
+          continue;
+        }
+        float lp = luminance(irradiance[p]);
+        float lumScale = 1.0f / (sigmaLuminance * sqrtf(blurredVar[p]) + 1e-4f);
+        vec3 np = f.normal[p];
+        float zp = f.depth[p];
+        float zScale = sigmaDepth * depthGrad[p] * step;
+        vec3 sum(0, 0, 0);
+        float weightSum = 0;
+        float varSum = 0;
+        for(int dy = -2; dy <= 2; dy++)
+        {
+          int qy = y + dy * step;
+          if(qy < 0 || qy >= h)
+            continue;
+          for(int dx = -2; dx <= 2; dx++)
+          {
+            int qx = x + dx * step;
+            if(qx < 0 || qx >= w)
+              continue;
+            int q = qx + qy * w;
+            if(f.material[q] != mat)
+              continue;
+            float wn = powf(fmax(0, glm::dot(np, f.normal[q])), normalPower);
+            if(wn == 0)
+              continue;
+            float dist = sqrtf(float(dx * dx + dy * dy));
+            float el = fabsf(luminance(irradiance[q]) - lp) * lumScale;
+            float ez = fabsf(f.depth[q] - zp) / (zScale * dist + 1e-3f);
+            float weight = kernel[abs(dx)] * kernel[abs(dy)] * wn * expf(-el - ez);
+            sum += weight * irradiance[q];
+            weightSum += weight;
+            varSum += weight * weight * var[q];
+          }
+        }
+        if(weightSum > 0)
+        {
+          nextIrradiance[p] = sum / weightSum;
+          nextVar[p] = varSum / (weightSum * weightSum);
+        }
+        else
+        {
+          nextIrradiance[p] = irradiance[p];
+          nextVar[p] = var[p];
+        }
+      }
+    });
+    irradiance.swap(nextIrradiance);
+    var.swap(nextVar);
+  }
+  for(int p = 0; p < n; p++)
+  {
+    if(f.material[p] != AIR)
+      color[p] = irradiance[p] * safeAlbedo(f.albedo[p]);
+  }
+}
+
+//name.png -> name_suffix.png
+static string featureName(string fname, string suffix)
+{
+  size_t dot = fname.rfind('.');
+  if(dot == string::npos)
+    return fname + "_" + suffix + ".png";
+  return fname.substr(0, dot) + "_" + suffix + fname.substr(dot);
+}
+
+void writeFeatures(const FeatureBuffers& f, string fname)
+{
+  const int n = RAY_W * RAY_H;
+  vector<byte> albedo(4 * n), normal(4 * n), depth(4 * n), material(4 * n);
+  for(int p = 0; p < n; p++)
+  {
+    for(int c = 0; c < 3; c++)
+    {
+      albedo[4 * p + c] = fmin(f.albedo[p][c], 1) * 255;
+      //map [-1, 1] to [0, 255]
+      normal[4 * p + c] = (f.normal[p][c] * 0.5f + 0.5f) * 255;
+      //near is white, far (and sky) is black
+      depth[4 * p + c] = 255 * (1 - fmin(f.depth[p] / FAR_PLANE, 1));
+      //spread the block IDs over the grey range
+      material[4 * p + c] = f.material[p] * (255 / (NUM_TILES - 1));
+    }
+    albedo[4 * p + 3] = normal[4 * p + 3] = depth[4 * p + 3] = material[4 * p + 3] = 255;
+  }
+  writePNG(featureName(fname, "albedo"), &albedo[0]);
+  writePNG(featureName(fname, "normal"), &normal[0]);
+  writePNG(featureName(fname, "depth"), &depth[0]);
+  writePNG(featureName(fname, "material"), &material[0]);
+}
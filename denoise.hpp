@@ -0,0 +1,36 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <string>
+#include <vector>
+#include "glmHeaders.hpp"
+#include "tiles.hpp"
+
+using std::string;
+using std::vector;
+
+//What each pixel's primary ray hit first (RAY_W * RAY_H of each)
+struct FeatureBuffers
+{
+  //texture color at the first hit (1 where the surface has no albedo of
+  //its own, like water and transparent texels)
+  vector<vec3> albedo;
+  vector<vec3> normal;
+  //distance from the camera to the first hit
+  vector<float> depth;
+  //AIR if the primary ray saw the sky directly
+  vector<Block> material;
+  void resize(int n);
+};
+
+//Edge-avoiding a-trous wavelet filter over a RAY_W x RAY_H image.
+//color is demodulated by albedo, filtered, then remodulated, so texture
+//detail is kept. Filter weights stop at normal, depth and material edges
+//and at luminance differences that are large relative to the pixel's
+//variance (of its mean luminance). Sky pixels are left unchanged.
+void denoise(vector<vec3>& color, const vector<float>& variance, const FeatureBuffers& features);
+//Write the feature buffers as PNGs named after fname
+//(e.g. out.png -> out_albedo.png, out_normal.png, out_depth.png, out_material.png)
+void writeFeatures(const FeatureBuffers& features, string fname);
+
+#endif
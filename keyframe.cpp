@@ -1,7 +1,10 @@
 #include "keyframe.hpp"
+#include "world.hpp"
+#include "tween.hpp"
 #include <cstdio>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 
 using std::cout;
 using std::ostringstream;
@@ -117,61 +120,49 @@ void setViewQuat(glm::quat q)
 void toggleFancy();
 extern double currentTime;
 
-void animate(float sec, string folder)
+//Place the camera for each frame of a video along the keyframe path
+struct CameraPath
 {
-  const int fps = 30;
-  //timesteps = how many frames to render
-  int timesteps = sec * fps;
+  CameraPath();
+  void place(int f, int timesteps);
+  vector<Spline> splines;
+  vector<float> arclenPrefix;
+  vector<glm::quat> keyframeQuats;
+};
+
+CameraPath::CameraPath()
+{
+  //a single keyframe is a stationary camera
+  if(keyframes.size() < 2)
+    return;
   //construct Catmull-Rom splines to pass through each keyframe
-  //need at least 4 keyframes to do this
-  int n = keyframes.size();
-  if(n == 0)
-  {
-    cout << "Need at least one keyframe!\n";
-    exit(1);
-  }
-  if(n == 1)
-  {
-    //stationary video but with animated water
-    toggleFancy();
-    player = keyframes[0].pos;
-    setViewQuat(eulerToQuat(keyframes[0].y, keyframes[0].p));
-    for(int f = 0; f < timesteps; f++)
-    {
-      cout << "Rendering frame " << f+1 << " of " << timesteps << '\n';
-      currentTime = float(f) / fps;
-      char fname[32];
-      sprintf(fname, "%s/f_%05d.png", folder.c_str(), f);
-      render(true, string(fname));
-    }
-  }
-  keyframes.insert(keyframes.begin(), keyframes.front());
-  keyframes.insert(keyframes.end(), keyframes.back());
-  n += 2;
+  //(with the first and last keyframe doubled as end control points)
+  vector<Keyframe> points = keyframes;
+  points.insert(points.begin(), points.front());
+  points.insert(points.end(), points.back());
+  int n = points.size();
   //construct a sequence of splines to pass between each pair of keyframes,
   //except the first two and last two control points
-  vector<Spline> splines;
   for(int i = 1; i < n - 2; i++)
   {
-    vec3 points[4];
+    vec3 controls[4];
     for(int j = 0; j < 4; j++)
     {
-      points[j] = keyframes[i + j - 1].pos;
+      controls[j] = points[i + j - 1].pos;
     }
-    splines.emplace_back(points);
+    splines.emplace_back(controls);
   }
-  vector<float> arclenPrefix(splines.size() + 1);
+  arclenPrefix.resize(splines.size() + 1);
   arclenPrefix[0] = 0;
   for(size_t i = 0; i < splines.size(); i++)
   {
     arclenPrefix[i + 1] = arclenPrefix[i] + splines[i].arclen;
   }
-  for(int i = 0; i <= splines.size(); i++)
+  for(size_t i = 0; i <= splines.size(); i++)
   {
     arclenPrefix[i] /= arclenPrefix[splines.size()];
   }
-  vector<glm::quat> keyframeQuats;
-  for(auto& kf : keyframes)
+  for(auto& kf : points)
   {
     keyframeQuats.push_back(eulerToQuat(kf.y, kf.p));
   }
@@ -183,66 +174,131 @@ void animate(float sec, string folder)
       keyframeQuats[i] *= -1.0f;
     }
   }
-  toggleFancy();
-  for(int f = 0; f < timesteps; f++)
+}
+
+void CameraPath::place(int f, int timesteps)
+{
+  if(splines.empty())
   {
-    cout << "Rendering frame " << f+1 << " of " << timesteps << '\n';
-    currentTime = float(f) / fps;
-    float t = float(f) / timesteps;
-    //use arclenPrefix to figure out which spline t corresponds to
-    //call the spline index s
-    int s = 0;
-    for(size_t i = 0; i < splines.size(); i++)
+    //stationary video but with animated water
+    player = keyframes[0].pos;
+    setViewQuat(eulerToQuat(keyframes[0].y, keyframes[0].p));
+    return;
+  }
+  float t = float(f) / timesteps;
+  //use arclenPrefix to figure out which spline t corresponds to
+  //call the spline index s
+  int s = 0;
+  for(size_t i = 0; i < splines.size(); i++)
+  {
+    if(t >= arclenPrefix[i] && t < arclenPrefix[i + 1])
     {
-      if(t >= arclenPrefix[i] && t < arclenPrefix[i + 1])
-      {
-        s = i;
-        break;
-      }
+      s = i;
+      break;
     }
-    Spline& spline = splines[s];
-    //get t parameter within spline (still arclength parameterized and in unit interval)
-    float st = (t - arclenPrefix[s]) / (arclenPrefix[s + 1] - arclenPrefix[s]);
-    //get final spline parameter u (NOT arclength parameterized)
-    float su = 0;
-    for(int i = 0; i < splineSteps; i++)
+  }
+  Spline& spline = splines[s];
+  //get t parameter within spline (still arclength parameterized and in unit interval)
+  float st = (t - arclenPrefix[s]) / (arclenPrefix[s + 1] - arclenPrefix[s]);
+  //get final spline parameter u (NOT arclength parameterized)
+  float su = 0;
+  for(int i = 0; i < splineSteps; i++)
+  {
+    if(st >= spline.ulength[i] && st < spline.ulength[i + 1])
     {
-      if(st >= spline.ulength[i] && st < spline.ulength[i + 1])
-      {
-        float k = (st - spline.ulength[i]) / (spline.ulength[i + 1] - spline.ulength[i]);
-        su = (float(i) + k) / splineSteps;
-        break;
-      }
+      float k = (st - spline.ulength[i]) / (spline.ulength[i + 1] - spline.ulength[i]);
+      su = (float(i) + k) / splineSteps;
+      break;
     }
-    //compute the point on spline
-    vec4 splineArg(1, su, su*su, su*su*su);
-    player = spline.matrix * splineArg;
-    //compute orientation by interpolating keyframe quaternions
-    glm::mat4 controlQuatMat;
-    quat controlQuats[4];
-    for(int i = 0; i < 4; i++)
+  }
+  //compute the point on spline
+  vec4 splineArg(1, su, su*su, su*su*su);
+  player = spline.matrix * splineArg;
+  //compute orientation by interpolating keyframe quaternions
+  glm::mat4 controlQuatMat;
+  quat controlQuats[4];
+  for(int i = 0; i < 4; i++)
+  {
+    controlQuats[i] = keyframeQuats[s + i - 1];
+  }
+  for(int i = 1; i < 4; i++)
+  {
+    if(glm::dot(controlQuats[i - 1], controlQuats[i]) < 0)
     {
-      controlQuats[i] = keyframeQuats[s + i - 1];
+      controlQuats[i] = -controlQuats[i];
     }
-    for(int i = 1; i < 4; i++)
+  }
+  for(int i = 0; i < 4; i++)
+  {
+    for(int j = 0; j < 4; j++)
     {
-      if(glm::dot(controlQuats[i - 1], controlQuats[i]) < 0)
-      {
-        controlQuats[i] = -controlQuats[i];
-      }
+      controlQuatMat[i][j] = controlQuats[i][j];
     }
-    for(int i = 0; i < 4; i++)
+  }
+  vec4 orientVector = normalize(controlQuatMat * catmullBasis * splineArg);
+  setViewQuat(quat(orientVector.w, orientVector.x, orientVector.y, orientVector.z));
+}
+
+void animate(float sec, string folder)
+{
+  const int fps = 30;
+  //timesteps = how many frames to render
+  int timesteps = sec * fps;
+  if(keyframes.size() == 0)
+  {
+    cout << "Need at least one keyframe!\n";
+    exit(1);
+  }
+  //terrain generation was started in the background, but frames
+  //must show the final world
+  waitForTerrain();
+  CameraPath path;
+  toggleFancy();
+  auto frameName = [&](int f)
+  {
+    char fname[32];
+    sprintf(fname, "/f_%05d.png", f);
+    return folder + fname;
+  };
+  //camera of frame f - 1, for motion vectors
+  auto lastViewProj = [&](int f)
+  {
+    path.place(std::max(f - 1, 0), timesteps);
+    return proj * view;
+  };
+  //every ANIMATE_STEP-th frame and the last are path traced, and the
+  //frames between each pair are interpolated
+  int step = std::max(ANIMATE_STEP, 1);
+  bool keep = step > 1 || WRITE_FEATURES;
+  TweenFrame last, next, between;
+  int lastRendered = 0;
+  for(int f = 0; f < timesteps; f++)
+  {
+    if(f % step && f != timesteps - 1)
+      continue;
+    mat4 motionViewProj = lastViewProj(f);
+    cout << "Rendering frame " << f+1 << " of " << timesteps << '\n';
+    path.place(f, timesteps);
+    currentTime = float(f) / fps;
+    render(true, frameName(f));
+    if(!keep)
+      continue;
+    captureFrame(next);
+    if(WRITE_FEATURES)
+      writeMotion(next, motionViewProj, frameName(f));
+    //fill in the frames since the last rendered one
+    for(int g = lastRendered + 1; g < f; g++)
     {
-      for(int j = 0; j < 4; j++)
-      {
-        controlQuatMat[i][j] = controlQuats[i][j];
-      }
+      motionViewProj = lastViewProj(g);
+      cout << "Interpolating frame " << g+1 << " of " << timesteps << '\n';
+      path.place(g, timesteps);
+      currentTime = float(g) / fps;
+      tweenFrame(last, next, float(g - lastRendered) / (f - lastRendered), between);
+      writeFrame(frameName(g));
+      if(WRITE_FEATURES)
+        writeMotion(between, motionViewProj, frameName(g));
     }
-    vec4 orientVector = normalize(controlQuatMat * catmullBasis * splineArg);
-    setViewQuat(quat(orientVector.w, orientVector.x, orientVector.y, orientVector.z));
-    char fname[32];
-    sprintf(fname, "%s/f_%05d.png", folder.c_str(), f);
-    render(true, string(fname));
+    std::swap(last, next);
+    lastRendered = f;
   }
 }
-
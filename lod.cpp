@@ -0,0 +1,89 @@
+#include "lod.hpp"
+#include <algorithm>
+
+//a cell byte is its most common material, plus this flag if every block
+//in the cell is that material
+#define UNIFORM 0x80
+#define MATERIAL_MASK 0x7F
+
+//cells[level], level 1 to LOD_LEVELS (level 0 is the blocks themselves)
+static byte* cells[LOD_LEVELS + 1];
+
+static inline int cellIndex(int level, int x, int y, int z)
+{
+  const int wy = (chunksY * 16) >> level;
+  const int wz = (chunksZ * 16) >> level;
+  return x * wy * wz + y * wz + z;
+}
+
+//Cell (x, y, z) of level (level 0 is the block)
+static inline byte cellAt(int level, int x, int y, int z)
+{
+  if(level == 0)
+    return getBlockFast(x, y, z) | UNIFORM;
+  return cells[level][cellIndex(level, x, y, z)];
+}
+
+//Combine the 8 cells of level - 1 that make up cell (x, y, z) of level
+static byte mergeCell(int level, int x, int y, int z)
+{
+  int counts[NUM_TILES] = {0};
+  bool uniform = true;
+  byte first = cellAt(level - 1, 2 * x, 2 * y, 2 * z);
+  for(int i = 0; i < 8; i++)
+  {
+    byte c = cellAt(level - 1, 2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + (i >> 2));
+    uniform = uniform && c == first && (c & UNIFORM);
+    counts[c & MATERIAL_MASK]++;
+  }
+  if(uniform)
+    return first;
+  //ties go to solid blocks, so thin walls don't vanish in the distance
+  int best = AIR;
+  for(int m = 1; m < NUM_TILES; m++)
+  {
+    if(counts[m] > counts[best] || (counts[m] == counts[best] && best == AIR))
+      best = m;
+  }
+  return best;
+}
+
+void buildLod()
+{
+  for(int level = 1; level <= LOD_LEVELS; level++)
+  {
+    if(!cells[level])
+      cells[level] = new byte[(chunksX * chunksY * chunksZ * 4096) >> (3 * level)];
+  }
+  updateLod(ivec3(0, 0, 0), ivec3(chunksX * 16, chunksY * 16, chunksZ * 16));
+}
+
+void updateLod(ivec3 lo, ivec3 hi)
+{
+  for(int level = 1; level <= LOD_LEVELS; level++)
+  {
+    for(int x = lo.x >> level; x <= (hi.x - 1) >> level; x++)
+    {
+      for(int y = lo.y >> level; y <= (hi.y - 1) >> level; y++)
+      {
+        for(int z = lo.z >> level; z <= (hi.z - 1) >> level; z++)
+          cells[level][cellIndex(level, x, y, z)] = mergeCell(level, x, y, z);
+      }
+    }
+  }
+}
+
+Block lodBlock(ivec3 b, int level, int& size)
+{
+  for(int l = LOD_LEVELS; l > 0; l--)
+  {
+    byte c = cells[l][cellIndex(l, b.x >> l, b.y >> l, b.z >> l)];
+    if((c & UNIFORM) || l <= level)
+    {
+      size = 1 << l;
+      return c & MATERIAL_MASK;
+    }
+  }
+  size = 1;
+  return getBlockFast(b.x, b.y, b.z);
+}
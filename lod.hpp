@@ -0,0 +1,24 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include "world.hpp"
+
+//Mip pyramid over the blocks ray tracing sees. Level L (1 to LOD_LEVELS)
+//has a cell for every aligned cube of 2^L blocks on a side, holding the
+//most common material in it and whether every block in it is that
+//material. collideRay crosses uniform cells in one step, since a ray can
+//only stop where the material changes. Rays with a footprint (see
+//VOXEL_LOD) also see any cell smaller than their footprint as filled with
+//its most common material.
+#define LOD_LEVELS 3
+
+//Build every level from the whole world
+void buildLod();
+//Rebuild the cells covering the blocks in box [lo, hi)
+void updateLod(ivec3 lo, ivec3 hi);
+//Material of block b with cells up to level seen as their most common
+//material (level 0 is exact), and the size of the aligned cube around b
+//that has that material at this level
+Block lodBlock(ivec3 b, int level, int& size);
+
+#endif
@@ -60,32 +60,69 @@ void initTexture()
 {
   glGenTextures(1, &textureID);
   glBindTexture(GL_TEXTURE_2D, textureID);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, RAY_W, RAY_H, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+  //big enough for any interactive resolution; frames use its lower left corner
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, MAX_RAY_W, MAX_RAY_H, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 }
 
+//camera and world of the last frame, to tell when nothing has changed
+mat4 lastView;
+int lastWorldVersion = -1;
+bool refining = false;
+//the refined view has converged, so frameBuf already holds the final image
+bool converged = false;
+//water stands still at this time while the view is being refined
+double refineTime;
+
 void renderFrame()
 {
-  //run the ray tracer
-  render(false);
+  //run the ray tracer, or keep refining the last frame if it would be the same
+  //(a still camera in a changing world still goes to render(), where
+  //SELECTIVE_RERENDER retraces only what changed)
+  bool still = IDLE_REFINE && view == lastView && worldVersion() == lastWorldVersion;
+  lastView = view;
+  lastWorldVersion = worldVersion();
+  double renderSeconds = 0;
+  if(still)
+  {
+    currentTime = refineTime;
+    if(!converged)
+      converged = refineFrame(!refining);
+    refining = true;
+  }
+  else
+  {
+    Uint64 start = SDL_GetPerformanceCounter();
+    render(false);
+    renderSeconds = double(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+    refining = false;
+    converged = false;
+    refineTime = currentTime;
+  }
   glClear(GL_COLOR_BUFFER_BIT);
   //update texture
   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, RAY_W, RAY_H, GL_RGBA, GL_UNSIGNED_BYTE, frameBuf);
-  //draw the texture over whole viewport
+  //draw the frame's part of the texture over whole viewport
+  float s = float(RAY_W) / MAX_RAY_W;
+  float t = float(RAY_H) / MAX_RAY_H;
   glColor3f(1, 1, 1);
   glColor4f(1, 1, 1, 1);
   glBegin(GL_QUADS);
-  glTexCoord2f(0, 1);
+  glTexCoord2f(0, t);
   glVertex2i(0, viewportH);
-  glTexCoord2f(1, 1);
+  glTexCoord2f(s, t);
   glVertex2i(viewportW, viewportH);
-  glTexCoord2f(1, 0);
+  glTexCoord2f(s, 0);
   glVertex2i(viewportW, 0);
   glTexCoord2f(0, 0);
   glVertex2i(0, 0);
   glEnd();
   SDL_GL_SwapWindow(window);
+  //size the next frame to the frame budget; refinement needs a fast frame
+  //at the new size to start from
+  if(!still && fitResolution(renderSeconds))
+    lastWorldVersion = -1;
 }
 
 void processInput()
@@ -211,21 +248,27 @@ int main(int argc, const char** argv)
     exit(1);
   }
   initAtlas();
+  initRay();
   initTexture();
   initPlayer();
   cout << "Generating terrain...\n";
-  terrainGen();
-  cout << "Done with terrain\n";
   if(doAnimate)
   {
     string keyframeFile = argv[2];
     string outputDir = argv[3];
     loadKeyframes(keyframeFile);
+    //generate around the start of the camera path first
+    if(keyframes.size())
+      startTerrainGen(keyframes[0].pos.x, keyframes[0].pos.z);
+    else
+      startTerrainGen(player.x, player.z);
     animate(atoi(argv[4]), outputDir);
     exit(0);
   }
   if(!doAnimate)
   {
+    //render right away; chunks show up as they are generated
+    startTerrainGen(player.x, player.z);
     SDL_RaiseWindow(window);
     time_t timeSec = time(NULL);
     int fps = 0;
@@ -2,6 +2,7 @@
 #include "world.hpp"
 #include "ray.hpp"
 #include <iostream>
+#include <algorithm>
 
 using std::cout;
 using std::ostream;
@@ -176,6 +177,13 @@ bool moveHitbox(Hitbox* hb, int dir, float d)
 void updatePlayer(float dt, int dx, int dz, float dyaw, float dpitch, bool jump, int dy)
 {
   bool viewStale = false;
+  //hover in place until the terrain under the player has been generated
+  //(outside the world there is none to wait for)
+  int groundX = floorf(player.x);
+  int groundY = std::min(std::max((int) player.y, 0), chunksY * 16 - 1);
+  int groundZ = floorf(player.z);
+  bool groundReady = !blockInBounds(groundX, groundY, groundZ) ||
+    chunkReady(groundX, groundY, groundZ);
   //setting dy directly means player is flying with T/G
   if(dy)
   {
@@ -222,7 +230,8 @@ void updatePlayer(float dt, int dx, int dz, float dyaw, float dpitch, bool jump,
   vec3 old = player;
   Hitbox hb(player.x - PLAYER_WIDTH / 2, player.y - PLAYER_EYE, player.z - PLAYER_WIDTH / 2, PLAYER_WIDTH, PLAYER_HEIGHT, PLAYER_WIDTH);
   //gravitational acceleration
-  vel.y -= dt * GRAVITY;
+  if(groundReady)
+    vel.y -= dt * GRAVITY;
   if(vel.y < -TERMINAL_VELOCITY)
     vel.y = -TERMINAL_VELOCITY;
   if(vel.y > 0)
@@ -286,6 +295,8 @@ void breakBlock()
   collideRay(player, look, target, normal, prevMat, nextMat, escape);
   if(escape || nextMat == WATER || nextMat == AIR)
     return;
+  if(!chunkReady(target.x, target.y, target.z))
+    return;
   if(glm::length(player - vec3(target.x + 0.5, target.y + 0.5, target.z + 0.5)) < PLAYER_REACH)
   {
     setBlock(AIR, target.x, target.y, target.z);
@@ -307,6 +318,8 @@ void placeBlock()
   if(glm::length(player - vec3(target.x + 0.5, target.y + 0.5, target.z + 0.5)) < PLAYER_REACH)
   {
     ivec3 place(target.x + normal.x, target.y + normal.y, target.z + normal.z);
+    if(!chunkReady(place.x, place.y, place.z))
+      return;
     setBlock(WATER, place.x, place.y, place.z);
   }
 }
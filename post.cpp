@@ -0,0 +1,111 @@
+#include "post.hpp"
+#include "ray.hpp"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+
+//rows per parallel work item
+#define POST_BAND 16
+
+vec3* hdrBuf = NULL;
+static vector<vec3> hdr;
+
+//4x4 Bayer matrix, as offsets in [0, 1) added before truncating to 8 bits
+static const float bayer[4][4] =
+{
+  {0.5f / 16, 8.5f / 16, 2.5f / 16, 10.5f / 16},
+  {12.5f / 16, 4.5f / 16, 14.5f / 16, 6.5f / 16},
+  {3.5f / 16, 11.5f / 16, 1.5f / 16, 9.5f / 16},
+  {15.5f / 16, 7.5f / 16, 13.5f / 16, 5.5f / 16}
+};
+
+void resizeHDR()
+{
+  size_t n = RAY_W * RAY_H;
+  if(hdr.size() != n)
+  {
+    hdr.resize(n);
+    hdrBuf = &hdr[0];
+  }
+}
+
+//Narkowicz's fit of the ACES filmic curve
+static inline float filmic(float v)
+{
+  return (v * (2.51f * v + 0.03f)) / (v * (2.43f * v + 0.59f) + 0.14f);
+}
+
+//v holds the 3 * RAY_W channels of a row
+static void postRow(float* v, byte* out, int y)
+{
+  const int n = 3 * RAY_W;
+  const float exposure = EXPOSURE;
+  for(int i = 0; i < n; i++)
+    v[i] *= exposure;
+  if(TONE_MAP == TONEMAP_FILMIC)
+  {
+    for(int i = 0; i < n; i++)
+      v[i] = filmic(v[i]);
+  }
+  for(int i = 0; i < n; i++)
+    v[i] = fmin(fmax(v[i], 0), 1);
+  if(DISPLAY_GAMMA != 1)
+  {
+    const float invGamma = 1 / DISPLAY_GAMMA;
+    for(int i = 0; i < n; i++)
+      v[i] = powf(v[i], invGamma);
+  }
+  //truncating (not rounding) keeps undithered output the same as before
+  //the float framebuffer existed
+  const float* offsets = bayer[y % 4];
+  for(int x = 0; x < RAY_W; x++)
+  {
+    float offset = DITHER ? offsets[x % 4] : 0;
+    out[4 * x + 0] = fmin(v[3 * x + 0] * 255 + offset, 255);
+    out[4 * x + 1] = fmin(v[3 * x + 1] * 255 + offset, 255);
+    out[4 * x + 2] = fmin(v[3 * x + 2] * 255 + offset, 255);
+    out[4 * x + 3] = 255;
+  }
+}
+
+void postProcess(byte* out, bool flip)
+{
+  int bands = (RAY_H + POST_BAND - 1) / POST_BAND;
+  parallelFor(bands, [&](int band)
+  {
+    vector<float> row(3 * RAY_W);
+    int end = std::min(RAY_H, (band + 1) * POST_BAND);
+    for(int y = band * POST_BAND; y < end; y++)
+    {
+      const float* src = &hdrBuf[y * RAY_W].x;
+      std::copy(src, src + 3 * RAY_W, row.begin());
+      int outRow = flip ? RAY_H - 1 - y : y;
+      postRow(&row[0], out + 4 * RAY_W * outRow, y);
+    }
+  });
+}
+
+void writePFM(std::string fname)
+{
+  FILE* f = fopen(fname.c_str(), "wb");
+  if(!f)
+  {
+    perror(fname.c_str());
+    return;
+  }
+  //negative scale means little-endian; rows go from the bottom up, which
+  //is already hdrBuf's order
+  fprintf(f, "PF\n%d %d\n-1.0\n", RAY_W, RAY_H);
+  vector<float> row(3 * RAY_W);
+  for(int y = 0; y < RAY_H; y++)
+  {
+    const float* src = &hdrBuf[y * RAY_W].x;
+    for(int i = 0; i < 3 * RAY_W; i++)
+      row[i] = src[i] * EXPOSURE;
+    fwrite(&row[0], sizeof(float), row.size(), f);
+  }
+  fclose(f);
+}
@@ -0,0 +1,25 @@
+#ifndef POST_H
+#define POST_H
+
+#include <string>
+#include "glmHeaders.hpp"
+#include "tiles.hpp"
+
+//Renders store linear colors (already scaled by brightnessAdjust) in a
+//float framebuffer, and a post-process stage turns them into 8-bit
+//pixels: exposure, tone map, gamma and dither, and for image files the
+//vertical flip. It runs in parallel over bands of rows, with each step a
+//flat loop over the row's floats so the compiler can vectorize it.
+
+//RAY_W * RAY_H colors, same layout as frameBuf (row 0 is the bottom)
+extern vec3* hdrBuf;
+
+//Make hdrBuf RAY_W * RAY_H (render() calls this at the start of every frame)
+void resizeHDR();
+//Post-process hdrBuf into RAY_W * RAY_H RGBA pixels, with the rows in
+//reverse order if flip
+void postProcess(byte* out, bool flip);
+//Write hdrBuf (times EXPOSURE) as a little-endian PFM image
+void writePFM(std::string fname);
+
+#endif
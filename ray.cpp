@@ -1,12 +1,24 @@
 #include "ray.hpp"
 #include "world.hpp"
 #include "player.hpp"
+#include "wavefront.hpp"
+#include "caustics.hpp"
+#include "shadows.hpp"
+#include "reservoirs.hpp"
+#include "post.hpp"
+#include "checkerboard.hpp"
+#include "reproject.hpp"
+#include "rerender.hpp"
+#include "lod.hpp"
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <sstream>
 #include <ctime>
 #include <pthread.h>
 #include <unistd.h>
+#include <functional>
+#include <algorithm>
 #include "stdatomic.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
@@ -26,8 +38,45 @@ int RAY_H = 200;
 int RAY_THREADS = 4;
 int RAYS_PER_PIXEL = 1;
 int MAX_BOUNCES = 1;
+ShadowMode SHADOW_MODE = SHADOWS_HARD;
+float RENDER_TIME_BUDGET = 0;
+float RENDER_NOISE_TARGET = 0;
+float PROGRESS_INTERVAL = 0;
+float ADAPTIVE_THRESHOLD = 0.01;
+bool DENOISE = false;
+bool WRITE_FEATURES = false;
+bool BOUNCE_LIGHT = false;
+bool IDLE_REFINE = true;
+int CHECKERBOARD = 0;
+bool REPROJECT = false;
+int ANIMATE_STEP = 1;
+bool SELECTIVE_RERENDER = true;
+float VOXEL_LOD = 0;
+float FRAME_BUDGET = 1 / 30.0;
+float EXPOSURE = 1;
+ToneMap TONE_MAP = TONEMAP_CLAMP;
+float DISPLAY_GAMMA = 1;
+bool DITHER = false;
+bool WRITE_PFM = false;
 bool fancy = false;
 
+//kernel used by renderPixel, chosen from the mode globals at the start of each frame
+typedef vec3 (*TraceKernel)(vec3 origin, vec3 direction, bool& exact);
+static TraceKernel traceKernel;
+static TraceKernel selectKernel();
+//fast frames with BOUNCE_LIGHT, SELECTIVE_RERENDER, REPROJECT or
+//CHECKERBOARD also record what each pixel's camera ray hit, and are
+//finished after all pixels are traced
+typedef vec3 (*SurfaceKernel)(vec3 origin, vec3 direction, PixelSurface* surface);
+static SurfaceKernel surfaceKernel;
+static SurfaceKernel selectSurfaceKernel();
+static PixelSurface* frameSurfaces;
+//if not NULL, only the pixels it picks are traced
+static bool (*traceSubset)(int x, int y);
+//pixels the last fast frame traced, if it reused the rest from earlier
+//frames by reprojection (otherwise the whole frame)
+static int framePixelsTraced;
+
 //#define DEBUG_OUT
 #ifdef DEBUG_OUT
 #define bmk(x) cout << x;
@@ -35,29 +84,8 @@ bool fancy = false;
 #define bmk(x)
 #endif
 
-//ambient factor should be small, as it is not realistic at
-//all (but just makes shadows easier on the eyes, less contrast)
-const float ambient = 0.08;
-//scale all specular light contributions by this
-const float specularScale = 1.2;
-const float specExpo = 80;
-//All materials use the same Blinn-Phong specular exponent,
-//but they have a range of specular intensities
-//If this is ever changed to be per-material, water should have
-//this exact value
-const vec3 skyBlue(0.34, 0.78, 1.0);
-const vec3 sunYellow(1, 1, 0.8);
-//color of water in non-fancy mode
-const vec3 waterBlue(0.25, 0.5, 0.7);
-//color applied to water when reflect/refract from air
-const vec3 waterHue = vec3(0.6, 0.85, 0.9);
-const float waterClarity = 0.96;
 //sunlight direction
 vec3 sunlight = normalize(vec3(1.0, -1, 0.5));
-const float cosSunRadius = 0.998;
-//multiply all ray contributions by this to keep image
-//brightness in a reasonable range
-const float brightnessAdjust = 5;
 
 ostream& operator<<(ostream& os, vec3 v)
 {
@@ -73,50 +101,111 @@ ostream& operator<<(ostream& os, vec4 v)
 
 static atomic_int workCounter;
 
-void renderPixel(int x, int y)
+//Primary rays are affine in pixel coordinates (the perspective divide is
+//the same for every point on a depth plane), so they are set up once per
+//frame from the exact unprojection of three pixels. Each ray then costs a
+//couple of multiply-adds per component, and pixel coordinates can be
+//fractional for subpixel jitter.
+struct CameraRays
+{
+  //near plane point and (unnormalized) direction at pixel (0, 0)
+  vec3 origin;
+  vec3 dir;
+  //change in each per pixel in x and y
+  vec3 originDx, originDy;
+  vec3 dirDx, dirDy;
+  //angle between neighbouring rays at the center of the frame
+  float pixelAngle;
+};
+
+static CameraRays camRays;
+
+//find ray through pixel (px, py) by inverse projecting two points in NDC,
+//one on near plane, one on far plane
+static void unprojectPixel(float px, float py, vec3& back, vec3& dir)
 {
-  //find ray by inverse projecting two points in NDC
-  //one on near plane, one on far plane
-  vec4 backWorld(
-      ((float) x / RAY_W) * 2 - 1,
-      ((float) y / RAY_H) * 2 - 1,
-      -1, 1);
+  vec4 backWorld((px / RAY_W) * 2 - 1, (py / RAY_H) * 2 - 1, -1, 1);
   backWorld = projInv * backWorld;
   backWorld /= backWorld.w;
   backWorld = viewInv * backWorld;
-  vec4 frontWorld(
-      ((float) x / RAY_W) * 2 - 1,
-      ((float) y / RAY_H) * 2 - 1,
-      1, 1);
+  vec4 frontWorld((px / RAY_W) * 2 - 1, (py / RAY_H) * 2 - 1, 1, 1);
   frontWorld = projInv * frontWorld;
   frontWorld /= frontWorld.w;
   frontWorld = viewInv * frontWorld;
-  vec3 direction = normalize(vec3(frontWorld) - vec3(backWorld));
+  back = vec3(backWorld);
+  dir = vec3(frontWorld) - vec3(backWorld);
+}
+
+void setupCameraRays()
+{
+  //use opposite edges of the frame (not neighboring pixels) so
+  //the per-pixel steps don't lose precision
+  vec3 backX, dirX, backY, dirY;
+  unprojectPixel(0, 0, camRays.origin, camRays.dir);
+  unprojectPixel(RAY_W, 0, backX, dirX);
+  unprojectPixel(0, RAY_H, backY, dirY);
+  camRays.originDx = (backX - camRays.origin) / float(RAY_W);
+  camRays.originDy = (backY - camRays.origin) / float(RAY_H);
+  camRays.dirDx = (dirX - camRays.dir) / float(RAY_W);
+  camRays.dirDy = (dirY - camRays.dir) / float(RAY_H);
+  vec3 center = camRays.dir + 0.5f * RAY_W * camRays.dirDx + 0.5f * RAY_H * camRays.dirDy;
+  camRays.pixelAngle = glm::length(camRays.dirDx) / glm::length(center);
+}
+
+void cameraRay(float px, float py, vec3& origin, vec3& direction)
+{
+  origin = camRays.origin + px * camRays.originDx + py * camRays.originDy;
+  direction = normalize(camRays.dir + px * camRays.dirDx + py * camRays.dirDy);
+}
+
+int pixelAt(const mat4& viewProj, vec4 pos)
+{
+  vec4 clip = viewProj * pos;
+  if(clip.w <= 0)
+    return -1;
+  int x = floorf((clip.x / clip.w + 1) * 0.5f * RAY_W + 0.5f);
+  int y = floorf((clip.y / clip.w + 1) * 0.5f * RAY_H + 0.5f);
+  if(x < 0 || y < 0 || x >= RAY_W || y >= RAY_H)
+    return -1;
+  return x + y * RAY_W;
+}
+
+void renderPixel(int x, int y)
+{
+  vec3 origin, direction;
+  cameraRay(x, y, origin, direction);
+  if(frameSurfaces)
+  {
+    //the module that began the frame stores the pixel
+    if(traceSubset && !traceSubset(x, y))
+      return;
+    PixelSurface* surface = frameSurfaces + x + y * RAY_W;
+    surface->pos = direction;
+    surface->normal = -direction;
+    surface->material = AIR;
+    surface->depth = INFINITY;
+    surface->valid = false;
+    surface->color = surfaceKernel(origin, direction, surface);
+    return;
+  }
   vec3 color(0, 0, 0);
-  if(fancy)
+  for(int j = 0; j < RAYS_PER_PIXEL; j++)
   {
-    for(int j = 0; j < RAYS_PER_PIXEL; j++)
+    bool exact = false;
+    color += traceKernel(origin, direction, exact);
+    if(exact)
     {
-      bool exact = false;
-      color += trace(vec3(backWorld), direction, exact);
-      if(exact)
-      {
-        color *= RAYS_PER_PIXEL;
-        break;
-      }
+      color *= RAYS_PER_PIXEL;
+      break;
     }
-    color /= RAYS_PER_PIXEL;
-  }
-  else
-  {
-    color = traceFast(vec3(backWorld), direction);
   }
-  //clamp colors and convert to 8-bit integer components
-  byte* pixel = frameBuf + 4 * (x + y * RAY_W);
-  pixel[0] = fmin(color.x, 1) * 255;
-  pixel[1] = fmin(color.y, 1) * 255;
-  pixel[2] = fmin(color.z, 1) * 255;
-  pixel[3] = 255;
+  color /= RAYS_PER_PIXEL;
+  storePixel(x, y, color);
+}
+
+void storePixel(int x, int y, vec3 color)
+{
+  hdrBuf[x + y * RAY_W] = color;
 }
 
 //worker function for threads
@@ -150,51 +239,236 @@ float fpart(float in)
   return in - ipart(in);
 }
 
+struct ParallelJob
+{
+  int n;
+  const std::function<void(int)>* fn;
+  atomic_int counter;
+};
+
+static void* parallelWorker(void* arg)
+{
+  ParallelJob* job = (ParallelJob*) arg;
+  while(true)
+  {
+    int i = atomic_fetch_add(&job->counter, 1);
+    if(i >= job->n)
+      return NULL;
+    (*job->fn)(i);
+  }
+  return NULL;
+}
+
+void parallelFor(int n, const std::function<void(int)>& fn)
+{
+  ParallelJob job;
+  job.n = n;
+  job.fn = &fn;
+  atomic_store(&job.counter, 0);
+  pthread_t threads[RAY_THREADS];
+  for(int i = 0; i < RAY_THREADS; i++)
+  {
+    pthread_create(threads + i, NULL, parallelWorker, &job);
+  }
+  for(int i = 0; i < RAY_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+void initRay()
+{
+  initWaterMap();
+  //progressive fancy render limits can be set from the environment
+  if(getenv("OCHD_TIME_BUDGET"))
+    RENDER_TIME_BUDGET = atof(getenv("OCHD_TIME_BUDGET"));
+  if(getenv("OCHD_NOISE_TARGET"))
+    RENDER_NOISE_TARGET = atof(getenv("OCHD_NOISE_TARGET"));
+  if(getenv("OCHD_PROGRESS_INTERVAL"))
+    PROGRESS_INTERVAL = atof(getenv("OCHD_PROGRESS_INTERVAL"));
+  if(getenv("OCHD_ADAPTIVE_THRESHOLD"))
+    ADAPTIVE_THRESHOLD = atof(getenv("OCHD_ADAPTIVE_THRESHOLD"));
+  if(getenv("OCHD_DENOISE"))
+    DENOISE = atoi(getenv("OCHD_DENOISE"));
+  if(getenv("OCHD_FEATURES"))
+    WRITE_FEATURES = atoi(getenv("OCHD_FEATURES"));
+  if(getenv("OCHD_BOUNCE_LIGHT"))
+    BOUNCE_LIGHT = atoi(getenv("OCHD_BOUNCE_LIGHT"));
+  if(getenv("OCHD_IDLE_REFINE"))
+    IDLE_REFINE = atoi(getenv("OCHD_IDLE_REFINE"));
+  if(getenv("OCHD_CHECKERBOARD"))
+    CHECKERBOARD = atoi(getenv("OCHD_CHECKERBOARD"));
+  if(getenv("OCHD_REPROJECT"))
+    REPROJECT = atoi(getenv("OCHD_REPROJECT"));
+  if(getenv("OCHD_SELECTIVE_RERENDER"))
+    SELECTIVE_RERENDER = atoi(getenv("OCHD_SELECTIVE_RERENDER"));
+  if(getenv("OCHD_ANIMATE_STEP"))
+    ANIMATE_STEP = atoi(getenv("OCHD_ANIMATE_STEP"));
+  if(getenv("OCHD_VOXEL_LOD"))
+    VOXEL_LOD = atof(getenv("OCHD_VOXEL_LOD"));
+  if(getenv("OCHD_FRAME_BUDGET"))
+    FRAME_BUDGET = atof(getenv("OCHD_FRAME_BUDGET"));
+  //display settings
+  if(getenv("OCHD_EXPOSURE"))
+    EXPOSURE = atof(getenv("OCHD_EXPOSURE"));
+  if(getenv("OCHD_TONEMAP"))
+    TONE_MAP = string(getenv("OCHD_TONEMAP")) == "filmic" ? TONEMAP_FILMIC : TONEMAP_CLAMP;
+  if(getenv("OCHD_GAMMA"))
+    DISPLAY_GAMMA = atof(getenv("OCHD_GAMMA"));
+  if(getenv("OCHD_DITHER"))
+    DITHER = atoi(getenv("OCHD_DITHER"));
+  if(getenv("OCHD_PFM"))
+    WRITE_PFM = atoi(getenv("OCHD_PFM"));
+}
+
 void render(bool write, string fname)
 {
   //reset counter - as image is rendered,
   //this is atomically incremented up to RAY_W * RAY_H
   atomic_store(&workCounter, 0);
-  pthread_t threads[RAY_THREADS];
-  //launch workers
-  for(int i = 0; i < RAY_THREADS; i++)
+  traceKernel = selectKernel();
+  surfaceKernel = selectSurfaceKernel();
+  resizeHDR();
+  setupCameraRays();
+  if(fancy && SHADOW_MODE == SHADOWS_SOFT)
+    buildCausticMap();
+  if(fancy && MAX_BOUNCES > 1)
   {
-    pthread_create(threads + i, NULL, renderWorker, NULL);
+    renderWavefront(write, fname);
   }
-  //then wait for all to terminate
-  while(true)
+  else
   {
-    int pixelsDone = atomic_load(&workCounter);
-    if(fancy)
+    //bounce light needs every pixel traced, so it takes precedence. While
+    //the view stays the same, selective re-rendering is exact, so it goes
+    //before the approximations for a moving camera.
+    frameSurfaces = NULL;
+    traceSubset = NULL;
+    bool still = !fancy && sameView();
+    if(!fancy && BOUNCE_LIGHT)
+      frameSurfaces = beginBounceFrame();
+    else if(!fancy && SELECTIVE_RERENDER && (still || (!REPROJECT && CHECKERBOARD <= 1)))
     {
-      printf("Image is %.1f%% done\n", 100.0 * pixelsDone / (RAY_W * RAY_H));
-      sleep(1);
+      frameSurfaces = beginRerenderFrame();
+      traceSubset = rerenderTraced;
     }
-    if(pixelsDone >= RAY_W * RAY_H)
+    else if(!fancy && REPROJECT)
     {
-      break;
+      frameSurfaces = beginReprojectFrame();
+      traceSubset = reprojectTraced;
     }
+    else if(!fancy && CHECKERBOARD > 1)
+    {
+      frameSurfaces = beginCheckerFrame();
+      traceSubset = checkerTraced;
+    }
+    pthread_t threads[RAY_THREADS];
+    //launch workers
+    for(int i = 0; i < RAY_THREADS; i++)
+    {
+      pthread_create(threads + i, NULL, renderWorker, NULL);
+    }
+    //then wait for all to terminate
+    while(true)
+    {
+      int pixelsDone = atomic_load(&workCounter);
+      if(fancy)
+      {
+        printf("Image is %.1f%% done\n", 100.0 * pixelsDone / (RAY_W * RAY_H));
+        sleep(1);
+      }
+      if(pixelsDone >= RAY_W * RAY_H)
+      {
+        break;
+      }
+    }
+    for(int i = 0; i < RAY_THREADS; i++)
+    {
+      pthread_join(threads[i], NULL);
+    }
+    framePixelsTraced = RAY_W * RAY_H;
+    if(traceSubset == reprojectTraced)
+    {
+      framePixelsTraced = 0;
+      for(int y = 0; y < RAY_H; y++)
+      {
+        for(int x = 0; x < RAY_W; x++)
+          framePixelsTraced += reprojectTraced(x, y);
+      }
+    }
+    if(traceSubset == rerenderTraced)
+      finishRerenderFrame();
+    else if(traceSubset == reprojectTraced)
+      finishReprojectFrame();
+    else if(traceSubset == checkerTraced)
+      reconstructCheckerboard();
+    else if(frameSurfaces)
+      resolveBounceLight();
   }
-  for(int i = 0; i < RAY_THREADS; i++)
+  postProcess(frameBuf, false);
+  if(write)
   {
-    pthread_join(threads[i], NULL);
+    writeFrame(fname);
   }
-  if(write)
+}
+
+void renderPixels(const vector<int>& pixels, int samples)
+{
+  traceKernel = selectKernel();
+  resizeHDR();
+  setupCameraRays();
+  //batches of pixels, like renderWorker takes
+  const int batchSize = 8;
+  int batches = (pixels.size() + batchSize - 1) / batchSize;
+  parallelFor(batches, [&](int batch)
   {
-    //need to vertically flip the image for STBI
-    for(int row = 0; row < RAY_H / 2; row++)
+    int end = std::min<int>(pixels.size(), (batch + 1) * batchSize);
+    for(int i = batch * batchSize; i < end; i++)
     {
-      for(int i = 0; i < 4 * RAY_W; i++)
+      int x = pixels[i] % RAY_W;
+      int y = pixels[i] / RAY_W;
+      vec3 origin, direction;
+      cameraRay(x, y, origin, direction);
+      vec3 color(0, 0, 0);
+      int j = 0;
+      while(j < samples)
       {
-        byte& top = frameBuf[row * 4 * RAY_W + i];
-        byte& bottom = frameBuf[(RAY_H - 1 - row) * 4 * RAY_W + i];
-        std::swap(top, bottom);
+        bool exact = false;
+        color += traceKernel(origin, direction, exact);
+        j++;
+        if(exact)
+          break;
       }
+      storePixel(x, y, color / float(j));
     }
-    stbi_write_png(fname.c_str(), RAY_W, RAY_H, 4, frameBuf, 4 * RAY_W);
+  });
+}
+
+void writeFrame(string fname)
+{
+  //post-process straight into PNG row order
+  byte* flipped = new byte[4 * RAY_W * RAY_H];
+  postProcess(flipped, true);
+  stbi_write_png(fname.c_str(), RAY_W, RAY_H, 4, flipped, 4 * RAY_W);
+  delete[] flipped;
+  if(WRITE_PFM)
+  {
+    size_t dot = fname.rfind('.');
+    writePFM((dot == string::npos ? fname : fname.substr(0, dot)) + ".pfm");
   }
 }
 
+void writePNG(string fname, const byte* pixels)
+{
+  //need to vertically flip the image for STBI
+  byte* flipped = new byte[4 * RAY_W * RAY_H];
+  for(int row = 0; row < RAY_H; row++)
+  {
+    memcpy(flipped + row * 4 * RAY_W, pixels + (RAY_H - 1 - row) * 4 * RAY_W, 4 * RAY_W);
+  }
+  stbi_write_png(fname.c_str(), RAY_W, RAY_H, 4, flipped, 4 * RAY_W);
+  delete[] flipped;
+}
+
 vec3 rayCubeIntersect(vec3 p, vec3 dir, vec3& norm, vec3 cube, float size)
 {
   if(dir.x > 0)
@@ -268,40 +542,77 @@ vec3 rayCubeIntersect(vec3 p, vec3 dir, vec3& norm, vec3 cube, float size)
 //desaturate a color
 //k = 0: return shade of grey with same magnitude
 //k = 1: return color
-static vec3 desaturate(vec3 color, float k)
+vec3 desaturate(vec3 color, float k)
 {
   float mag = glm::length(color);
   return vec3(color.x * k + mag * (1-k), color.y * k + mag * (1-k), color.z * k + mag * (1-k));
 }
 
-vec3 trace(vec3 origin, vec3 direction, bool& exact)
+//any unit vector perpendicular to n
+static inline vec3 perpendicular(vec3 n)
+{
+  if(fabsf(n.x) > 0.5f)
+    return normalize(vec3(n.z, 0, -n.x));
+  return normalize(vec3(0, -n.z, n.y));
+}
+
+vec3 sampleCosine(vec3 normal, float u1, float u2)
+{
+  //uniform point on the unit disc, projected up onto the hemisphere
+  float r = sqrtf(u1);
+  float phi = 2 * M_PI * u2;
+  vec3 t = perpendicular(normal);
+  vec3 b = glm::cross(normal, t);
+  return normalize(r * cosf(phi) * t + r * sinf(phi) * b + sqrtf(fmax(0, 1 - u1)) * normal);
+}
+
+vec3 sampleSunCone(float u1, float u2)
 {
+  //cos(angle from the sun's center) is uniform in [cosSunRadius, 1]
+  float cosTheta = 1 - u1 * (1 - cosSunRadius);
+  float sinTheta = sqrtf(fmax(0, 1 - cosTheta * cosTheta));
+  float phi = 2 * M_PI * u2;
+  vec3 toSun = -sunlight;
+  vec3 t = perpendicular(toSun);
+  vec3 b = glm::cross(toSun, t);
+  return normalize(sinTheta * cosf(phi) * t + sinTheta * sinf(phi) * b + cosTheta * toSun);
+}
+
+//Trace kernels are instantiated per shadow mode and (for fancy mode) per
+//bounce budget, so the per-hit mode and material checks fold away at compile
+//time; BOUNCES == 0 is the generic kernel that reads MAX_BOUNCES at runtime
+template<ShadowMode S>
+static bool sunVisible(vec3 pos, vec3 norm, bool air, vec3 toSun = -sunlight);
+template<ShadowMode S>
+static float sunLight(vec3 pos, vec3 norm, bool air, vec3 toSun);
+
+template<int BOUNCES, ShadowMode S>
+static vec3 tracePath(vec3 origin, vec3 direction, bool& exact)
+{
+  const int maxBounces = BOUNCES ? BOUNCES : MAX_BOUNCES;
   exact = false;
   //iterate through blocks, finding the faces that player is looking through
   int bounces = 0;
   //color components take on the product of texture components
   vec3 color(0, 0, 0);
   vec3 colorInfluence(1, 1, 1);
-  while(bounces < MAX_BOUNCES)
+  //weight of the sun if the current ray reaches it
+  float sunWeight = 1;
+  float spread = cameraSpread();
+  while(bounces < maxBounces)
   {
     ivec3 blockIter;
     bool escape = false;
     vec3 normal;
     Block prevMaterial, nextMaterial;
-    vec3 intersect = collideRay(origin, direction, blockIter, normal, prevMaterial, nextMaterial, escape);
+    vec3 intersect = collideRay(origin, direction, blockIter, normal, prevMaterial, nextMaterial, escape, spread);
     if(escape)
     {
-      return processEscapedRay(intersect, direction, color, colorInfluence, bounces, exact);
+      return processEscapedRay(intersect, direction, color, colorInfluence, bounces, sunWeight, float(rand()) / RAND_MAX, exact);
     }
     //hit a block: sample texture at point of intersection
-    vec4 texel;
-    if(normal.y > 0)
-      texel = sample(nextMaterial, TOP, intersect.x, intersect.y, intersect.z);
-    else if(normal.y < 0)
-      texel = sample(nextMaterial, BOTTOM, intersect.x, intersect.y, intersect.z);
-    else
-      texel = sample(nextMaterial, SIDE, intersect.x, intersect.y, intersect.z);
-    if(MAX_BOUNCES == 1)
+    vec4 texel = sample(nextMaterial, faceSide(normal), intersect.x, intersect.y, intersect.z);
+    if(BOUNCES == 1)
     {
       exact = true;
       if(nextMaterial == WATER)
@@ -334,10 +645,9 @@ vec3 trace(vec3 origin, vec3 direction, bool& exact)
     }
     bool refract = false;
     //note: if reflecting off opaque material, these won't be used
-    float nPrev = refractIndex[prevMaterial];
-    float nNext = refractIndex[nextMaterial];
-    float r0 = (nPrev - nNext) / (nPrev + nNext);
-    r0 *= r0;
+    float nPrev = materials[prevMaterial].ior;
+    float nNext = materials[nextMaterial].ior;
+    float r0 = fresnelR0[prevMaterial][nextMaterial];
     //compute the Fresnel term using Schlick's approximatoin
     //this is used to decide refraction vs. reflection,
     //and also to determine reflectivity during reflection
@@ -393,30 +703,37 @@ vec3 trace(vec3 origin, vec3 direction, bool& exact)
         //use waterBlue as the reflection color for water
         texel = vec4(waterBlue, 1);
       }
-      float spec = ks[nextMaterial];
-      float diff = kd[nextMaterial];
-      bool shadowed = !visibleFromSun(intersect, normal, nPrev == 1);
+      float spec = materials[nextMaterial].ks;
+      float diff = materials[nextMaterial].kd;
+      //probability of continuing with a diffuse (vs. mirror) bounce
+      float diffuseChance = nextMaterial == WATER ? 0 : diff / (spec + diff);
+      //with soft shadows the sun is a disc: light it from a random point
+      //on it. This is all the sun light a diffuse bounce gets, so bounces
+      //that happen to hit the sun don't count it again.
+      vec3 toSun = -sunlight;
+      if(S == SHADOWS_SOFT)
+        toSun = sampleSunCone(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX);
+      float light = sunLight<S>(intersect, normal, nPrev == 1, toSun);
       float diffContrib = 0;
       float specContrib = 0;
-      if(!shadowed)
+      if(light > 0)
       {
-        diffContrib = diff * fmax(0, glm::dot(normal, -sunlight));
-        vec3 halfway = -normalize(direction + sunlight);
-        specContrib = spec * specularScale * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+        float cosSun = fmax(0, glm::dot(normal, toSun));
+        diffContrib = light * diff * cosSun;
+        vec3 halfway = normalize(toSun - direction);
+        specContrib = light * spec * specularScale * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
       }
       color += colorInfluence * ((ambient + diffContrib) * vec3(texel) + specContrib * vec3(1, 1, 1));
       //decide whether to add specular or diffuse lighting from sun,
       //based on ks and kd for nextMaterial
       float reflectivity = fmin(1, 0.5 * (spec + 0.3 * diff) * fresnel);
       vec3 bounceColor;
-      if(nextMaterial != WATER && float(rand()) / RAND_MAX > (spec / (spec + diff)))
+      if(float(rand()) / RAND_MAX < diffuseChance)
       {
-        //direction is a weighted average of specular reflection and a random direction
-        //this approximates the BRDF of a fairly rough Lambertian surface
-        vec3 r = normalize(vec3(float(rand()) / RAND_MAX, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX));
-        if(glm::dot(r, normal) < 0)
-          r = -r;
-        direction = normalize(0.7f * r + 0.3f * glm::reflect(direction, normal));
+        //Lambertian bounce, importance sampled by the cosine term
+        direction = sampleCosine(normal, float(rand()) / RAND_MAX, float(rand()) / RAND_MAX);
+        spread = bounceSpread();
+        sunWeight = 0;
         //update color influence: very little light from subsequent bounces
         //will reflect off diffuse material and have significant color bleed
         bounceColor = reflectivity * desaturate(vec3(texel), 1 - fresnel);
@@ -424,156 +741,329 @@ vec3 trace(vec3 origin, vec3 direction, bool& exact)
       else
       {
         direction = normalize(glm::reflect(direction, normal));
+        //the direct term has no mirror lobe, so a mirror bounce keeps the sun
+        sunWeight = 1;
         //Specular reflection doesn't affect ray color, only intensity
         bounceColor = reflectivity * desaturate(vec3(texel), 0);
       }
       colorInfluence *= bounceColor;
       bounces++;
+      if(bounces >= rouletteMinBounces)
+      {
+        //Russian roulette: dim paths stop early, and survivors are
+        //brightened to make up for the ones that stopped
+        float survive = fmin(1, fmax(colorInfluence.x, fmax(colorInfluence.y, colorInfluence.z)));
+        if(float(rand()) / RAND_MAX >= survive)
+          return color * brightnessAdjust;
+        colorInfluence /= survive;
+      }
     }
     //continue from intersection
     origin = intersect;
   }
-  //light bounced too many times without reaching light source,
-  //so no light contributed from this ray
-  return vec3(0, 0, 0);
+  //out of bounces: keep the light gathered so far
+  return color * brightnessAdjust;
 }
 
-vec3 traceFast(vec3 origin, vec3 direction)
+//Fast mode splits rays at water surfaces into a reflected and a refracted
+//child. The resulting ray tree is walked with an explicit stack: children
+//are only spawned up to FAST_MAX_DEPTH and when their weight is at least
+//FAST_MIN_WEIGHT, and a pixel traces at most FAST_RAY_BUDGET rays, so the
+//cost of a pixel stays bounded whatever the camera looks at.
+#define FAST_MAX_DEPTH 4
+#define FAST_MIN_WEIGHT 0.02f
+#define FAST_RAY_BUDGET 12
+
+struct FastRay
 {
-  //color components take on the product of texture components
-  vec3 color(0, 0, 0);
-  vec3 colorInfluence(1, 1, 1);
-  while(true)
+  vec3 origin;
+  vec3 direction;
+  //fraction of this ray's color that reaches the pixel
+  vec3 weight;
+  int depth;
+};
+
+static inline void pushFastRay(FastRay* stack, int& top, vec3 origin, vec3 direction, vec3 weight, int depth)
+{
+  if(depth > FAST_MAX_DEPTH || fmax(weight.x, fmax(weight.y, weight.z)) < FAST_MIN_WEIGHT)
+    return;
+  FastRay ray = {origin, direction, weight, depth};
+  stack[top++] = ray;
+}
+
+static inline void recordSurface(PixelSurface* surface, vec3 pos, vec3 normal, Block material, float depth)
+{
+  surface->pos = pos;
+  surface->normal = normal;
+  surface->material = material;
+  surface->depth = depth;
+}
+
+//If surface isn't NULL, the first thing the camera ray can't see straight
+//through is recorded there (the caller fills it in for sky first).
+template<ShadowMode S>
+static vec3 traceFastKernel(vec3 origin, vec3 direction, PixelSurface* surface)
+{
+  //depth-first, so at most one pending sibling per level
+  FastRay stack[FAST_MAX_DEPTH + 2];
+  int top = 0;
+  const float spread = cameraSpread();
+  pushFastRay(stack, top, origin, direction, vec3(1, 1, 1), 0);
+  vec3 pixel(0, 0, 0);
+  int budget = FAST_RAY_BUDGET;
+  while(top > 0 && budget > 0)
   {
-    ivec3 blockIter;
-    bool escape = false;
-    vec3 normal;
-    Block prevMaterial, nextMaterial;
-    vec3 intersect = collideRay(origin, direction, blockIter, normal, prevMaterial, nextMaterial, escape);
-    if(escape)
-    {
-      //return processEscapedRayFast(intersect, direction, color, colorInfluence);
-      if(glm::dot(direction, -sunlight) >= cosSunRadius)
-        return sunYellow;
-      else if(prevMaterial == AIR)
-        return skyBlue;
-      else
-        return vec3(0, 0, 0);
-    }
-    //hit a block: sample texture at point of intersection
-    vec4 texel;
-    if(normal.y > 0)
-      texel = sample(nextMaterial, TOP, intersect.x, intersect.y, intersect.z);
-    else if(normal.y < 0)
-      texel = sample(nextMaterial, BOTTOM, intersect.x, intersect.y, intersect.z);
-    else
-      texel = sample(nextMaterial, SIDE, intersect.x, intersect.y, intersect.z);
-    //depending on transparency of sampled texel and approx. Fresnel reflection coefficient,
-    //choose whether to reflect or refract
-    if(isTransparent(prevMaterial) && nextMaterial == WATER)
-    {
-      //entering water from transparent material
-      //apply water hue to all light from now on
-      if(normal.y < 0)
-        normal = -waterNormal(intersect);
-      else if(normal.y > 0)
-        normal = waterNormal(intersect);
-    }
-    else if(isTransparent(nextMaterial) && prevMaterial == WATER)
+    budget--;
+    FastRay ray = stack[--top];
+    origin = ray.origin;
+    direction = ray.direction;
+    //color components take on the product of texture components
+    vec3 colorInfluence = ray.weight;
+    //follow the ray through transparent texels until it ends or splits
+    while(true)
     {
-      //apply a blue color to ray
-      if(normal.y < 0)
-        normal = -waterNormal(intersect);
-      else if(normal.y > 0)
-        normal = waterNormal(intersect);
-    }
-    if(prevMaterial == WATER)
-    {
-      colorInfluence *= waterHue * powf(waterClarity, glm::length(origin - intersect));
-    }
-    const float nwater = refractIndex[WATER];
-    if(nextMaterial == WATER)
-    {
-      float r0 = (1 - nwater) / (1 + nwater);
-      r0 *= r0;
-      //compute the Fresnel term using Schlick's approximatoin
-      //this is used to decide refraction vs. reflection,
-      //and also to determine reflectivity during reflection
-      float cosTheta = fabsf(glm::dot(normal, direction));
-      float fresnel = r0 + (1 - r0) * powf(1 - cosTheta, 5);
-      //draw refracted ray of whatever's underwater, and reflected ray of what's above water
-      vec3 reflectRay = normalize(glm::reflect(direction, normal));
-      vec3 refractRay = normalize(glm::refract(direction, normal, 1 / refractIndex[WATER]));
-      vec3 base = (1-fresnel) * waterHue * traceFast(intersect, refractRay) + fresnel * traceFast(intersect, reflectRay);
-      if(visibleFromSun(intersect, normal, false))
+      ivec3 blockIter;
+      bool escape = false;
+      vec3 normal;
+      Block prevMaterial, nextMaterial;
+      vec3 intersect = collideRay(origin, direction, blockIter, normal, prevMaterial, nextMaterial, escape, spread);
+      if(escape)
       {
-        //compute additional specular component
-        vec3 halfway = -normalize(direction + sunlight);
-        float specContrib = specularScale * ks[WATER] * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
-        return base + specContrib * vec3(1, 1, 1);
+        if(glm::dot(direction, -sunlight) >= cosSunRadius)
+          pixel += colorInfluence * sunYellow;
+        else if(prevMaterial == AIR)
+          pixel += colorInfluence * skyBlue;
+        break;
       }
-    }
-    if(texel.w < 0.5)
-    {
-      //from one transparent medium to another
-      if(prevMaterial == WATER && nextMaterial == AIR)
+      //hit a block: sample texture at point of intersection
+      vec4 texel = sample(nextMaterial, faceSide(normal), intersect.x, intersect.y, intersect.z);
+      if((isTransparent(prevMaterial) && nextMaterial == WATER) ||
+          (isTransparent(nextMaterial) && prevMaterial == WATER))
       {
-        float cosCriticalAngle = cosf(asinf(1 / nwater));
+        if(surface && ray.depth == 0)
+          recordSurface(surface, intersect, normal, WATER, glm::length(intersect - ray.origin));
+        //crossing the water surface: use the perturbed water normal
+        if(normal.y < 0)
+          normal = -waterNormal(intersect);
+        else if(normal.y > 0)
+          normal = waterNormal(intersect);
+      }
+      if(prevMaterial == WATER)
+      {
+        colorInfluence *= waterHue * powf(waterClarity, glm::length(origin - intersect));
+      }
+      const float nwater = materials[WATER].ior;
+      if(nextMaterial == WATER)
+      {
+        const float r0 = fresnelR0[AIR][WATER];
+        //compute the Fresnel term using Schlick's approximation
+        //this weights the reflected and refracted children
         float cosTheta = fabsf(glm::dot(normal, direction));
-        if(cosTheta > cosCriticalAngle)
+        float fresnel = r0 + (1 - r0) * powf(1 - cosTheta, 5);
+        //draw refracted ray of whatever's underwater, and reflected ray of what's above water
+        vec3 reflectRay = normalize(glm::reflect(direction, normal));
+        vec3 refractRay = normalize(glm::refract(direction, normal, 1 / nwater));
+        vec3 reflectWeight = fresnel * colorInfluence;
+        vec3 refractWeight = (1 - fresnel) * waterHue * colorInfluence;
+        //push the heavier child last so it is traced first
+        if(fresnel < 0.5)
         {
-          return waterHue * traceFast(intersect, normalize(glm::refract(direction, normal, nwater)));
+          pushFastRay(stack, top, intersect, reflectRay, reflectWeight, ray.depth + 1);
+          pushFastRay(stack, top, intersect, refractRay, refractWeight, ray.depth + 1);
         }
         else
         {
-          //total internal reflection, return dark water color to represent
-          return 0.3f * waterBlue;
+          pushFastRay(stack, top, intersect, refractRay, refractWeight, ray.depth + 1);
+          pushFastRay(stack, top, intersect, reflectRay, reflectWeight, ray.depth + 1);
         }
+        if(sunVisible<S>(intersect, normal, false))
+        {
+          //compute additional specular component
+          vec3 halfway = -normalize(direction + sunlight);
+          float specContrib = specularScale * materials[WATER].ks * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+          pixel += colorInfluence * specContrib;
+        }
+        break;
       }
-    }
-    if(texel.w > 0.5)
-    {
-      //reflect ray
-      if(prevMaterial == WATER)
-      {
-        //passed through some water, so reduce ray's brightness
-        float waterDarken = powf(waterClarity, glm::length(origin - intersect));
-        colorInfluence *= waterDarken;
-      }
-      if(nextMaterial == WATER)
+      if(texel.w < 0.5 && prevMaterial == WATER && nextMaterial == AIR)
       {
-        //use waterBlue as the reflection color for water
-        texel = vec4(waterBlue, 1);
+        float cosCriticalAngle = cosf(asinf(1 / nwater));
+        float cosTheta = fabsf(glm::dot(normal, direction));
+        if(cosTheta > cosCriticalAngle)
+        {
+          pushFastRay(stack, top, intersect, normalize(glm::refract(direction, normal, nwater)),
+              waterHue * colorInfluence, ray.depth + 1);
+        }
+        else
+        {
+          //total internal reflection, use dark water color to represent
+          pixel += colorInfluence * 0.3f * waterBlue;
+        }
+        break;
       }
-      float spec = ks[nextMaterial];
-      float diff = kd[nextMaterial];
-      //pretend point of interest is in air because it's a much faster test
-      //this means shadows won't be refracted in fast mode
-      bool shadowed = !visibleFromSun(intersect, normal, prevMaterial != WATER);
-      float diffContrib = 0;
-      float specContrib = 0;
-      if(!shadowed)
+      if(texel.w > 0.5)
       {
-        diffContrib = diff * fmax(0, glm::dot(normal, -sunlight));
-        vec3 halfway = -normalize(sunlight + direction);
-        specContrib = specularScale * spec * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+        //reflect ray
+        if(prevMaterial == WATER)
+        {
+          //passed through some water, so reduce ray's brightness
+          float waterDarken = powf(waterClarity, glm::length(origin - intersect));
+          colorInfluence *= waterDarken;
+        }
+        float spec = materials[nextMaterial].ks;
+        float diff = materials[nextMaterial].kd;
+        //pretend point of interest is in air because it's a much faster test
+        //this means shadows won't be refracted in fast mode
+        bool shadowed = !sunVisible<S>(intersect, normal, prevMaterial != WATER);
+        float diffContrib = 0;
+        float specContrib = 0;
+        if(!shadowed)
+        {
+          diffContrib = diff * fmax(0, glm::dot(normal, -sunlight));
+          vec3 halfway = -normalize(sunlight + direction);
+          specContrib = specularScale * spec * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+        }
+        pixel += brightnessAdjust * colorInfluence * ((ambient + diffContrib) * vec3(texel) + vec3(1, 1, 1) * specContrib);
+        if(surface && ray.depth == 0)
+        {
+          recordSurface(surface, intersect, normal, nextMaterial, glm::length(intersect - ray.origin));
+          surface->weight = brightnessAdjust * colorInfluence * vec3(texel);
+          surface->valid = prevMaterial != WATER;
+        }
+        break;
       }
-      return brightnessAdjust * colorInfluence * ((ambient + diffContrib) * vec3(texel) + vec3(1, 1, 1) * specContrib);
-    }
-    else
-    {
       //continue tracing in same direction
       origin = intersect;
     }
   }
-  //light bounced too many times without reaching light source,
-  //so no light contributed from this ray
-  return vec3(0, 0, 0);
+  return pixel;
+}
+
+
+//fast mode kernels always produce an exact color from one ray
+template<ShadowMode S>
+static vec3 fastKernel(vec3 origin, vec3 direction, bool& exact)
+{
+  exact = true;
+  return traceFastKernel<S>(origin, direction, NULL);
+}
+
+template<ShadowMode S>
+static TraceKernel fancyKernel(int bounces)
+{
+  switch(bounces)
+  {
+    case 1: return tracePath<1, S>;
+    case 2: return tracePath<2, S>;
+    case 3: return tracePath<3, S>;
+    case 4: return tracePath<4, S>;
+    case 5: return tracePath<5, S>;
+    case 6: return tracePath<6, S>;
+    case 7: return tracePath<7, S>;
+    case 8: return tracePath<8, S>;
+    default: return tracePath<0, S>;
+  }
+}
+
+template<ShadowMode S>
+static TraceKernel kernelFor()
+{
+  return fancy ? fancyKernel<S>(MAX_BOUNCES) : fastKernel<S>;
+}
+
+static TraceKernel selectKernel()
+{
+  switch(SHADOW_MODE)
+  {
+    case SHADOWS_OFF: return kernelFor<SHADOWS_OFF>();
+    case SHADOWS_HARD: return kernelFor<SHADOWS_HARD>();
+    default: return kernelFor<SHADOWS_SOFT>();
+  }
+}
+
+static SurfaceKernel selectSurfaceKernel()
+{
+  switch(SHADOW_MODE)
+  {
+    case SHADOWS_OFF: return traceFastKernel<SHADOWS_OFF>;
+    case SHADOWS_HARD: return traceFastKernel<SHADOWS_HARD>;
+    default: return traceFastKernel<SHADOWS_SOFT>;
+  }
+}
+
+vec3 trace(vec3 origin, vec3 direction, bool& exact)
+{
+  return tracePath<0, SHADOWS_SOFT>(origin, direction, exact);
+}
+
+vec3 traceFast(vec3 origin, vec3 direction)
+{
+  return traceFastKernel<SHADOWS_HARD>(origin, direction, NULL);
+}
+
+//a diffusely bounced ray is one sample of a whole hemisphere, so its
+//footprint grows fast
+#define BOUNCE_SPREAD 0.25f
+
+float cameraSpread()
+{
+  return camRays.pixelAngle * VOXEL_LOD;
+}
+
+float bounceSpread()
+{
+  return VOXEL_LOD > 0 ? BOUNCE_SPREAD : 0;
+}
+
+//Level of detail for a ray with footprint width: the last level whose
+//cells are no bigger than it
+static inline int lodLevel(float width)
+{
+  return width < 2 ? 0 : (width < 4 ? 1 : (width < 8 ? 2 : LOD_LEVELS));
+}
+
+//Slab test of a ray against box [lo, hi]. On a hit, tEnter is the ray
+//parameter where the ray enters the box (0 if origin is already inside) and
+//axis is the axis of the entry face (-1 if origin is inside).
+static bool clipRay(vec3 origin, vec3 direction, vec3 lo, vec3 hi, float& tEnter, int& axis)
+{
+  float tNear = 0;
+  float tFar = INFINITY;
+  axis = -1;
+  for(int i = 0; i < 3; i++)
+  {
+    if(direction[i] == 0)
+    {
+      if(origin[i] < lo[i] || origin[i] > hi[i])
+        return false;
+      continue;
+    }
+    float t0 = (lo[i] - origin[i]) / direction[i];
+    float t1 = (hi[i] - origin[i]) / direction[i];
+    if(t0 > t1)
+      std::swap(t0, t1);
+    if(t0 > tNear)
+    {
+      tNear = t0;
+      axis = i;
+    }
+    tFar = fmin(tFar, t1);
+  }
+  tEnter = tNear;
+  return tNear <= tFar;
+}
+
+static inline bool blockInBox(ivec3 b, ivec3 lo, ivec3 hi)
+{
+  return b.x >= lo.x && b.y >= lo.y && b.z >= lo.z &&
+    b.x < hi.x && b.y < hi.y && b.z < hi.z;
 }
 
-vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block& prevMat, Block& nextMat, bool& escape)
+vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block& prevMat, Block& nextMat, bool& escape, float spread)
 {
   const float eps = 1e-16;
+  const vec3 start = origin;
+  int size;
   ivec3 blockIter(ipart(origin.x + eps), ipart(origin.y + eps), ipart(origin.z + eps));
   if(fpart(origin.x) < eps && direction.x < 0)
     blockIter.x -= 1;
@@ -581,16 +1071,53 @@ vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block&
     blockIter.y -= 1;
   if(fpart(origin.z) < eps && direction.z < 0)
     blockIter.z -= 1;
-  if(blockIter.x < 0 || blockIter.y < 0 || blockIter.z < 0 ||
-      blockIter.x >= chunksX * 16 || blockIter.y >= chunksY * 16 || blockIter.z >= chunksZ * 16)
+  //only traverse the part of the ray inside the occupied part of the world:
+  //everything else is air (or the ocean outside the world)
+  ivec3 lo, hi;
+  occupiedBounds(lo, hi);
+  if(!blockInBox(blockIter, lo, hi))
   {
-    escape = true;
-    block = blockIter;
-    return origin;
+    //material the ray starts in
+    prevMat = blockInBounds(blockIter.x, blockIter.y, blockIter.z) ?
+      getBlockFast(blockIter.x, blockIter.y, blockIter.z) : getBlock(blockIter.x, blockIter.y, blockIter.z);
+    float tEnter;
+    int axis;
+    if(!clipRay(origin, direction, vec3(lo), vec3(hi), tEnter, axis))
+    {
+      //ray can't hit anything
+      escape = true;
+      block = blockIter;
+      return origin;
+    }
+    if(axis >= 0)
+    {
+      //move to the entry point, snapped onto the entry face
+      origin += tEnter * direction;
+      origin[axis] = direction[axis] > 0 ? lo[axis] : hi[axis];
+      normal = vec3(0, 0, 0);
+      normal[axis] = direction[axis] > 0 ? -1 : 1;
+    }
+    for(int i = 0; i < 3; i++)
+    {
+      origin[i] = fmin(fmax(origin[i], lo[i]), hi[i]);
+      blockIter[i] = ipart(origin[i] + eps);
+      if(fpart(origin[i]) < eps && direction[i] < 0)
+        blockIter[i] -= 1;
+      blockIter[i] = std::min(std::max(blockIter[i], lo[i]), hi[i] - 1);
+    }
+    nextMat = lodBlock(blockIter, lodLevel(glm::length(origin - start) * spread), size);
+    if(axis >= 0 && nextMat != prevMat)
+    {
+      //hit the face of the box
+      escape = false;
+      block = blockIter;
+      return origin;
+    }
   }
   while(true)
   {
-    prevMat = getBlockFast(blockIter.x, blockIter.y, blockIter.z);
+    int level = spread > 0 ? lodLevel(glm::length(origin - start) * spread) : 0;
+    prevMat = lodBlock(blockIter, level, size);
     //trace ray through space until a different material is encountered
     int cx = ipart(blockIter.x / 16.0f);
     int cy = ipart(blockIter.y / 16.0f);
@@ -600,12 +1127,17 @@ vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block&
     bool emptyChunk = !chunkInBounds || (chunkInBounds && chunks[cx][cy][cz].numFilled == 0);
     //the origin (corner) of chunk that ray is in (or about to enter, if on boundary)
     vec3 chunkOrigin(16 * cx, 16 * cy, 16 * cz);
-    //point of intersection with next cube face (block or chunk)
+    //point of intersection with next cube face (chunk, or the largest cube
+    //of blocks around blockIter that are all prevMat)
     vec3 intersect;
     if(emptyChunk)
       intersect = rayCubeIntersect(origin, direction, normal, chunkOrigin, 16);
     else
-      intersect = rayCubeIntersect(origin, direction, normal, blockIter, 1);
+    {
+      //size is a power of 2 and blockIter isn't negative
+      vec3 cube(blockIter.x & -size, blockIter.y & -size, blockIter.z & -size);
+      intersect = rayCubeIntersect(origin, direction, normal, cube, size);
+    }
     ivec3 nextBlock(ipart(intersect.x + eps), ipart(intersect.y + eps), ipart(intersect.z + eps));
     if(fpart(intersect.x) < eps && direction.x < 0)
       nextBlock.x -= 1;
@@ -613,14 +1145,15 @@ vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block&
       nextBlock.y -= 1;
     if(fpart(intersect.z) < eps && direction.z < 0)
       nextBlock.z -= 1;
-    if(nextBlock.x < 0 || nextBlock.y < 0 || nextBlock.z < 0 ||
-        nextBlock.x >= chunksX * 16 || nextBlock.y >= chunksY * 16 || nextBlock.z >= chunksZ * 16)
+    if(!blockInBox(nextBlock, lo, hi))
     {
       escape = true;
       block = nextBlock;
       return intersect;
     }
-    nextMat = getBlockFast(nextBlock.x, nextBlock.y, nextBlock.z);
+    if(spread > 0)
+      level = lodLevel(glm::length(intersect - start) * spread);
+    nextMat = lodBlock(nextBlock, level, size);
     if(prevMat != nextMat)
     {
       escape = false;
@@ -633,16 +1166,93 @@ vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block&
   return vec3(0, 0, 0);
 }
 
+//Water normals are perturbed by two Perlin noise fields sampled at
+//(u, v) = position.xz + currentTime / 6. Time only translates the fields,
+//so they are precomputed once into a tileable map over (u, v), and each
+//lookup is a bilinear fetch at the shifted position.
+//This approximates the fields rather than reproducing them: the map
+//repeats every WATER_MAP_PERIOD blocks, and the fbm keeps only the octaves
+//below the map's Nyquist limit (WATER_MAP_RES / 2 cycles per block).
+//With lacunarity 2.5 the 4th octave would be ~15.6 cycles per block and
+//alias, so WATER_OCTAVES is 3 (top octave ~6.3 cycles per block).
+#define WATER_MAP_PERIOD 64   //tile size in blocks
+#define WATER_MAP_RES 16      //texels per block
+#define WATER_MAP_SIZE (WATER_MAP_PERIOD * WATER_MAP_RES)
+#define WATER_OCTAVES 3
+
+//x and z components of the unnormalized normal, interleaved
+static float* waterMap;
+
+static void waterNoise(float u, float v, float& p1, float& p2)
+{
+  p1 = stb_perlin_fbm_noise3(u, 0, v, 2.5, 0.6, WATER_OCTAVES, 0, 0, 0);
+  p2 = stb_perlin_fbm_noise3(1000 - u, 0, 1000 - v, 2.5, 0.6, WATER_OCTAVES, 0, 0, 0);
+}
+
+void initWaterMap()
+{
+  if(waterMap)
+    return;
+  waterMap = new float[2 * WATER_MAP_SIZE * WATER_MAP_SIZE];
+  const float period = WATER_MAP_PERIOD;
+  parallelFor(WATER_MAP_SIZE, [=](int row)
+  {
+    float v = float(row) / WATER_MAP_RES;
+    for(int col = 0; col < WATER_MAP_SIZE; col++)
+    {
+      float u = float(col) / WATER_MAP_RES;
+      //make the noise periodic by blending it with copies shifted by one
+      //period, weighted so the result wraps around seamlessly. The copies
+      //are uncorrelated, so dividing by the weights' norm keeps the contrast
+      //uniform across the tile.
+      float wu = u / period;
+      float wv = v / period;
+      float w[4] = {(1 - wu) * (1 - wv), wu * (1 - wv), (1 - wu) * wv, wu * wv};
+      float p1 = 0;
+      float p2 = 0;
+      float wsq = 0;
+      for(int i = 0; i < 4; i++)
+      {
+        float n1, n2;
+        waterNoise(u - (i % 2) * period, v - (i / 2) * period, n1, n2);
+        p1 += w[i] * n1;
+        p2 += w[i] * n2;
+        wsq += w[i] * w[i];
+      }
+      p1 /= sqrtf(wsq);
+      p2 /= sqrtf(wsq);
+      float* texel = waterMap + 2 * (row * WATER_MAP_SIZE + col);
+      texel[0] = 0.03 * sin(p1);
+      texel[1] = 0.03 * sin(p2);
+    }
+  });
+}
+
 vec3 waterNormal(vec3 position)
 {
-  //use Perlin noise to generate the normal
   float t = currentTime;
-  float p1 = stb_perlin_fbm_noise3(position.x + t / 6, 0, position.z + t / 6, 2.5, 0.6, 4, 0, 0, 0);
-  float p2 = stb_perlin_fbm_noise3(1000 - position.x - t / 6, 0, 1000 - position.z - t / 6, 2.5, 0.6, 4, 0, 0, 0);
-  return normalize(vec3(0.03 * sin(p1), 1, 0.03 * sin(p2)));
+  float u = (position.x + t / 6) * WATER_MAP_RES;
+  float v = (position.z + t / 6) * WATER_MAP_RES;
+  float iu = ipart(u);
+  float iv = ipart(v);
+  float fu = u - iu;
+  float fv = v - iv;
+  //map size is a power of 2, so masking wraps negative coordinates too
+  const int mask = WATER_MAP_SIZE - 1;
+  int c0 = (int) iu & mask;
+  int c1 = (c0 + 1) & mask;
+  int r0 = (int) iv & mask;
+  int r1 = (r0 + 1) & mask;
+  const float* t00 = waterMap + 2 * (r0 * WATER_MAP_SIZE + c0);
+  const float* t01 = waterMap + 2 * (r0 * WATER_MAP_SIZE + c1);
+  const float* t10 = waterMap + 2 * (r1 * WATER_MAP_SIZE + c0);
+  const float* t11 = waterMap + 2 * (r1 * WATER_MAP_SIZE + c1);
+  float nx = (1 - fv) * ((1 - fu) * t00[0] + fu * t01[0]) + fv * ((1 - fu) * t10[0] + fu * t11[0]);
+  float nz = (1 - fv) * ((1 - fu) * t00[1] + fu * t01[1]) + fv * ((1 - fu) * t10[1] + fu * t11[1]);
+  return normalize(vec3(nx, 1, nz));
 }
 
-vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence, int bounces, bool& exact)
+vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence, int bounces, float sunWeight, float u, bool& exact)
 {
   float sunDot = glm::dot(direction, -sunlight);
   //if nothing has been hit yet, return sky or sun color
@@ -654,25 +1264,24 @@ vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence
     else
       return skyBlue * (0.7f + 0.3f * acosf(direction.y));
   }
-  float nwater = refractIndex[WATER];
+  float nwater = materials[WATER].ior;
   if(pos.y >= seaLevel && direction.y < 0)
   {
     vec3 intersect = pos - direction * ((pos.y - seaLevel) / direction.y);
     vec3 normal = waterNormal(intersect);
     //smaller angle of incidence means more likely to refract (Fresnel)
     float cosTheta = fabsf(glm::dot(normal, -direction));
-    float r0 = (1 - nwater) / (1 + nwater);
-    r0 *= r0;
+    const float r0 = fresnelR0[AIR][WATER];
     float fresnel = r0 + (1 - r0) * powf(1 - cosTheta, 5);
     //reflect off surface; apply water color times ambient, diffuse, specular
-    if(float(rand()) / RAND_MAX <= fresnel)
+    if(u <= fresnel)
     {
-      float diffContrib = kd[WATER] * fmax(0, glm::dot(-sunlight, normal));
+      float diffContrib = materials[WATER].kd * fmax(0, glm::dot(-sunlight, normal));
       vec3 halfway = -normalize(direction + sunlight);
-      float specContrib = ks[WATER] * specularScale * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+      float specContrib = materials[WATER].ks * specularScale * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
       color += colorInfluence * ((ambient + diffContrib) * waterBlue + specContrib * vec3(1, 1, 1));
       direction = normalize(glm::reflect(direction, normal));
-      float reflectivity = fmin(1, 0.5 * (ks[WATER] + 0.3 * kd[WATER]) * fresnel);
+      float reflectivity = fmin(1, 0.5 * (materials[WATER].ks + 0.3 * materials[WATER].kd) * fresnel);
       colorInfluence *= (reflectivity * desaturate(waterBlue, 0));
     }
     else
@@ -706,7 +1315,7 @@ vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence
     if(fancy && direction.y > 0)
     {
       if(glm::dot(direction, -sunlight) >= cosSunRadius)
-        color += colorInfluence * 0.2f * sunYellow;
+        color += colorInfluence * 0.2f * sunWeight * sunYellow;
       else
         color += colorInfluence * 0.2f * skyBlue;
     }
@@ -725,29 +1334,65 @@ vec3 processEscapedRayFast(vec3 pos, vec3 direction, vec3 color, vec3 colorInflu
     else
       return skyBlue * (0.7f + 0.3f * acosf(direction.y));
   }
-  float nwater = refractIndex[WATER];
   if(pos.y >= seaLevel && direction.y < 0)
   {
     vec3 intersect = pos - direction * ((pos.y - seaLevel) / direction.y);
     vec3 normal = waterNormal(intersect);
     //smaller angle of incidence means more likely to refract (Fresnel)
     float cosTheta = fabsf(glm::dot(normal, -direction));
-    float r0 = (1 - nwater) / (1 + nwater);
-    r0 *= r0;
+    const float r0 = fresnelR0[AIR][WATER];
     float fresnel = r0 + (1 - r0) * powf(1 - cosTheta, 5);
     //reflect off surface; apply water color times ambient, diffuse, specular
-    float diffContrib = kd[WATER] * fmax(0, glm::dot(-sunlight, normal));
+    float diffContrib = materials[WATER].kd * fmax(0, glm::dot(-sunlight, normal));
     vec3 halfway = -normalize(direction + sunlight);
-    float specContrib = specularScale * ks[WATER] * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+    float specContrib = specularScale * materials[WATER].ks * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
     return brightnessAdjust * fresnel * (waterBlue * (ambient + diffContrib) + vec3(1, 1, 1) * specContrib);
   }
   return color * brightnessAdjust;
 }
 
-bool visibleFromSun(vec3 pos, vec3 norm, bool air)
+//does a ray from pos towards the sun escape? (only transparent
+//texels in the way)
+static bool sunRayEscapes(vec3 pos, vec3 toSun)
+{
+  ivec3 block;
+  vec3 normal;
+  Block prevMat, nextMat;
+  bool escape = false;
+  while(true)
+  {
+    pos = collideRay(pos, toSun, block, normal, prevMat, nextMat, escape);
+    if(escape)
+      return true;
+    if(!isTransparent(nextMat))
+    {
+      //hit a fully opaque block
+      return false;
+    }
+    else
+    {
+      if(nextMat == GLASS || nextMat == LEAF)
+      {
+        //need to sample texture to figure out if specific
+        //point of intersection is transparent or not
+        if(opaqueTexel(nextMat, faceSide(normal), pos.x, pos.y, pos.z))
+        {
+          return false;
+        }
+        //otherwise, continue ray
+      }
+    }
+  }
+  return false;
+}
+
+template<ShadowMode S>
+static bool sunVisible(vec3 pos, vec3 norm, bool air, vec3 toSun)
 {
-  if(glm::dot(norm, sunlight) > 0)
+  if(glm::dot(norm, toSun) < 0)
     return false;
+  if(S == SHADOWS_OFF)
+    return true;
   const float eps = 1e-16;
   //if ray is not in air,
   //  use monte carlo (if any one of several rays escapes
@@ -757,51 +1402,28 @@ bool visibleFromSun(vec3 pos, vec3 norm, bool air)
   //  check if center of sun is directly visible
   if(air)
   {
-    ivec3 block;
-    vec3 normal;
-    Block prevMat, nextMat;
-    bool escape = false;
-    //does a ray pointed at the sun escape?
-    while(true)
+    //hard shadows on block faces always aim at the sun's center, so
+    //they are cached per face cell
+    if(S == SHADOWS_HARD && fmax(fabsf(norm.x), fmax(fabsf(norm.y), fabsf(norm.z))) == 1)
     {
-      pos = collideRay(pos, -sunlight, block, normal, prevMat, nextMat, escape);
-      if(escape)
-        return true;
-      if(!isTransparent(nextMat))
-      {
-        //hit a fully opaque block
-        return false;
-      }
-      else
-      {
-        if(nextMat == GLASS || nextMat == LEAF)
-        {
-          //need to sample texture to figure out if specific
-          //point of intersection is transparent or not
-          //note that top and bottom of glass/leaves are identical
-          vec4 texel;
-          if(normal.y != 0)
-            texel = sample(nextMat, TOP, pos.x, pos.y, pos.z);
-          else
-            texel = sample(nextMat, SIDE, pos.x, pos.y, pos.z);
-          if(texel.w > 0.5)
-          {
-            return false;
-          }
-          //otherwise, continue ray
-        }
-      }
+      bool lit;
+      int generation = shadowGeneration();
+      if(lookupShadow(pos, norm, lit))
+        return lit;
+      lit = sunRayEscapes(shadowCellCenter(pos, norm), toSun);
+      storeShadow(pos, norm, lit, generation);
+      return lit;
     }
-    return false;
+    return sunRayEscapes(pos, toSun);
   }
   else
   {
     ivec3 blockIter(ipart(pos.x + eps), ipart(pos.y + eps), ipart(pos.z + eps));
-    float n = refractIndex[getBlock(blockIter.x, blockIter.y, blockIter.z)];
-    int samples = fancy ? 5 : 1;
+    float n = materials[getBlock(blockIter.x, blockIter.y, blockIter.z)].ior;
+    const int samples = S == SHADOWS_SOFT ? 5 : 1;
     for(int i = 0; i < samples; i++)
     {
-      vec3 dir = -normalize(glm::refract(sunlight, vec3(0, 1, 0), 1 / n));
+      vec3 dir = -normalize(glm::refract(-toSun, vec3(0, 1, 0), 1 / n));
       vec3 normal;
       ivec3 block;  //don't care about this
       Block prevMat, nextMat;
@@ -822,22 +1444,14 @@ bool visibleFromSun(vec3 pos, vec3 norm, bool air)
           else
             normal = normalize(float(i) * normal + float(samples - i) * waterNormal(intersect));
         }
-        //sample texel
-        vec4 texel;
-        if(normal.y > 0)
-          texel = sample(nextMat, TOP, intersect.x, intersect.y, intersect.z);
-        else if(normal.y < 0)
-          texel = sample(nextMat, BOTTOM, intersect.x, intersect.y, intersect.z);
-        else
-          texel = sample(nextMat, SIDE, intersect.x, intersect.y, intersect.z);
-        if(texel.w > 0.5)
+        if(opaqueTexel(nextMat, faceSide(normal), intersect.x, intersect.y, intersect.z))
         {
           //opaque texel, this ray doesn't reach sun
           break;
         }
         //otherwise, use refraction or total internal reflection to update dir
-        float nPrev = refractIndex[prevMat];
-        float nNext = refractIndex[nextMat];
+        float nPrev = materials[prevMat].ior;
+        float nNext = materials[nextMat].ior;
         if(nPrev > nNext)
         {
           //Going down in index: need to check for total internal reflection
@@ -868,6 +1482,37 @@ bool visibleFromSun(vec3 pos, vec3 norm, bool air)
   }
 }
 
+//Like sunVisible, but fancy renders look underwater points up in the
+//caustic map instead of tracing them
+template<ShadowMode S>
+static float sunLight(vec3 pos, vec3 norm, bool air, vec3 toSun)
+{
+  float light;
+  if(S == SHADOWS_SOFT && !air && glm::dot(norm, toSun) >= 0 && causticLight(pos, light))
+    return light;
+  return sunVisible<S>(pos, norm, air, toSun) ? 1 : 0;
+}
+
+float sunTransmittance(vec3 pos, vec3 norm, bool air, vec3 toSun)
+{
+  switch(SHADOW_MODE)
+  {
+    case SHADOWS_OFF: return sunLight<SHADOWS_OFF>(pos, norm, air, toSun);
+    case SHADOWS_HARD: return sunLight<SHADOWS_HARD>(pos, norm, air, toSun);
+    default: return sunLight<SHADOWS_SOFT>(pos, norm, air, toSun);
+  }
+}
+
+bool visibleFromSun(vec3 pos, vec3 norm, bool air, vec3 toSun)
+{
+  switch(SHADOW_MODE)
+  {
+    case SHADOWS_OFF: return sunVisible<SHADOWS_OFF>(pos, norm, air, toSun);
+    case SHADOWS_HARD: return sunVisible<SHADOWS_HARD>(pos, norm, air, toSun);
+    default: return sunVisible<SHADOWS_SOFT>(pos, norm, air, toSun);
+  }
+}
+
 void toggleFancy()
 {
   fancy = !fancy;
@@ -876,7 +1521,8 @@ void toggleFancy()
     RAY_W = 640;
     RAY_H = 480;
     MAX_BOUNCES = 6;
-    RAYS_PER_PIXEL = 150;
+    RAYS_PER_PIXEL = FANCY_RAYS_PER_PIXEL;
+    SHADOW_MODE = SHADOWS_SOFT;
     RAY_THREADS = 4;
   }
   else
@@ -886,8 +1532,59 @@ void toggleFancy()
     MAX_BOUNCES = 1;
     RAYS_PER_PIXEL = 1;
     RAY_THREADS = 4;
+    SHADOW_MODE = SHADOWS_HARD;
   }
   delete[] frameBuf;
   frameBuf = new byte[4 * RAY_W * RAY_H];
 }
 
+bool refineFrame(bool restart)
+{
+  //trace like fancy renders do, at the interactive resolution
+  int bounces = MAX_BOUNCES;
+  ShadowMode shadows = SHADOW_MODE;
+  MAX_BOUNCES = 6;
+  SHADOW_MODE = SHADOWS_SOFT;
+  setupCameraRays();
+  resizeHDR();
+  if(restart)
+    buildCausticMap();
+  bool converged = refineWavefront(restart);
+  postProcess(frameBuf, false);
+  MAX_BOUNCES = bounces;
+  SHADOW_MODE = shadows;
+  return converged;
+}
+
+//Render time is roughly proportional to the pixel count, so the
+//controller tracks a smoothed cost per pixel and sizes the next frame to
+//fit the budget. A reprojected frame traces a varying part of its pixels
+//and any frame can need all of them again, so its cost is charged to the
+//pixels it traced. (Checkerboard frames always trace the same fraction,
+//so they are charged to the whole frame.) Widths are multiples of 8 (so the height stays exact),
+//and only change when the fit is off by at least two steps, by at most
+//a quarter per frame, so the resolution doesn't flicker.
+bool fitResolution(double renderSeconds)
+{
+  static double costPerPixel = 0;
+  if(FRAME_BUDGET <= 0)
+    return false;
+  //a selectively re-rendered frame's time doesn't reflect a full frame's
+  if(traceSubset == rerenderTraced && rerenderPartial())
+    return false;
+  double cost = renderSeconds / std::max(framePixelsTraced, 1);
+  costPerPixel = costPerPixel > 0 ? 0.7 * costPerPixel + 0.3 * cost : cost;
+  double pixels = FRAME_BUDGET / costPerPixel;
+  int w = sqrt(pixels * 8 / 5);
+  w = std::max(std::min(w, RAY_W * 5 / 4), RAY_W * 4 / 5);
+  w = std::max(std::min(w / 8 * 8, MAX_RAY_W), MIN_RAY_W);
+  if(abs(w - RAY_W) < 16 && w != MIN_RAY_W && w != MAX_RAY_W)
+    return false;
+  if(w == RAY_W)
+    return false;
+  RAY_W = w;
+  RAY_H = w * 5 / 8;
+  delete[] frameBuf;
+  frameBuf = new byte[4 * RAY_W * RAY_H];
+  return true;
+}
@@ -3,10 +3,13 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <functional>
 #include "glmHeaders.hpp"
 #include "world.hpp"
 
 using std::string;
+using std::vector;
 
 //Width and height of the raytraced framebuffer
 extern int RAY_W;
@@ -14,25 +17,224 @@ extern int RAY_H;
 extern int RAY_THREADS;
 extern int RAYS_PER_PIXEL;
 extern int MAX_BOUNCES;
+//samples per pixel of fancy renders, which idle refinement also stops at
+const int FANCY_RAYS_PER_PIXEL = 150;
+
+//Interactive frames keep the 8:5 shape of the default 320x200, but
+//fitResolution scales them between these sizes to keep render() within
+//FRAME_BUDGET seconds (0 = fixed resolution). initRay reads FRAME_BUDGET
+//from OCHD_FRAME_BUDGET if set.
+const int MIN_RAY_W = 128;
+const int MIN_RAY_H = 80;
+const int MAX_RAY_W = 640;
+const int MAX_RAY_H = 400;
+extern float FRAME_BUDGET;
+
+enum ShadowMode
+{
+  //only surfaces facing away from the sun are shadowed
+  SHADOWS_OFF,
+  //one ray towards the sun (refracted once if the point is underwater)
+  SHADOWS_HARD,
+  //several perturbed refracted rays when the point isn't in air
+  SHADOWS_SOFT
+};
+
+extern ShadowMode SHADOW_MODE;
+
+enum ToneMap
+{
+  //clip each channel at 1
+  TONEMAP_CLAMP,
+  //roll highlights off with a filmic curve
+  TONEMAP_FILMIC
+};
+
+//Post-processing of the float framebuffer (see post.hpp): colors are
+//multiplied by EXPOSURE, tone mapped with TONE_MAP, raised to
+//1 / DISPLAY_GAMMA and, if DITHER, dithered before they are cut to 8 bits.
+//If WRITE_PFM, image files also get a float copy in PFM format.
+//The defaults only clip colors, like renders always have.
+//initRay reads these from OCHD_EXPOSURE, OCHD_TONEMAP (clamp or filmic),
+//OCHD_GAMMA, OCHD_DITHER and OCHD_PFM if set.
+extern float EXPOSURE;
+extern ToneMap TONE_MAP;
+extern float DISPLAY_GAMMA;
+extern bool DITHER;
+extern bool WRITE_PFM;
+
+//Fancy renders are progressive: each pass adds one sample per pixel, up to
+//RAYS_PER_PIXEL. They can stop early after RENDER_TIME_BUDGET seconds, or
+//once the estimated noise (RMS standard error of pixel luminance, 0-1) is
+//below RENDER_NOISE_TARGET. When writing a file, the image so far is also
+//written every PROGRESS_INTERVAL seconds. 0 disables each of these.
+//Sampling is adaptive: after 16 samples, a pixel stops taking more once
+//the 95% confidence interval of its mean luminance is within
+//ADAPTIVE_THRESHOLD (0 = every pixel takes every pass).
+//If DENOISE, the result is run through the feature-guided denoiser.
+//If WRITE_FEATURES, the first-hit albedo, normal, depth and material
+//buffers are written next to the output image (and for --animate frames,
+//motion vectors too).
+//If BOUNCE_LIGHT, fast mode replaces the ambient term with one bounce of
+//diffuse light (see reservoirs.hpp).
+//If IDLE_REFINE, the interactive view is refined with fancy samples while
+//the camera and world stay still (see refineFrame), until it converges.
+//Water stops moving meanwhile, and render() is not called at all.
+//If CHECKERBOARD is 2 or 4, fast frames without bounce light only trace
+//that fraction of their pixels (see checkerboard.hpp).
+//If REPROJECT, fast frames without bounce light reuse the last frame's
+//colors where they can and only trace the rest (see reproject.hpp). It
+//takes precedence over CHECKERBOARD.
+//If SELECTIVE_RERENDER, fast frames without bounce light only retrace
+//pixels whose paths changed while the view stays the same (see
+//rerender.hpp). With IDLE_REFINE, refinement wins whenever the world is
+//also still, so this only covers the frames of block edits; without it,
+//it covers every frame of a still camera, with water still moving.
+//If ANIMATE_STEP is more than 1, --animate only renders every
+//ANIMATE_STEP-th frame and interpolates the rest (see tween.hpp).
+//If VOXEL_LOD is more than 0, camera rays see cubes of blocks that cover
+//less than VOXEL_LOD pixels as their most common material, and so do
+//rays after a diffuse bounce far enough from it (see lod.hpp).
+//initRay reads these from OCHD_TIME_BUDGET, OCHD_NOISE_TARGET,
+//OCHD_PROGRESS_INTERVAL, OCHD_ADAPTIVE_THRESHOLD, OCHD_DENOISE,
+//OCHD_FEATURES, OCHD_BOUNCE_LIGHT,
+//OCHD_IDLE_REFINE, OCHD_CHECKERBOARD, OCHD_REPROJECT,
+//OCHD_SELECTIVE_RERENDER, OCHD_ANIMATE_STEP and OCHD_VOXEL_LOD if set.
+extern float RENDER_TIME_BUDGET;
+extern float RENDER_NOISE_TARGET;
+extern float PROGRESS_INTERVAL;
+extern float ADAPTIVE_THRESHOLD;
+extern bool DENOISE;
+extern bool WRITE_FEATURES;
+extern bool BOUNCE_LIGHT;
+extern bool IDLE_REFINE;
+extern int CHECKERBOARD;
+extern bool REPROJECT;
+extern bool SELECTIVE_RERENDER;
+extern int ANIMATE_STEP;
+extern float VOXEL_LOD;
 
 //RAY_W * RAY_H RGBA color values
 extern byte* frameBuf;
 
+//ambient factor should be small, as it is not realistic at
+//all (but just makes shadows easier on the eyes, less contrast)
+const float ambient = 0.08;
+//scale all specular light contributions by this
+const float specularScale = 1.2;
+const float specExpo = 80;
+//All materials use the same Blinn-Phong specular exponent,
+//but they have a range of specular intensities
+//If this is ever changed to be per-material, water should have
+//this exact value
+const vec3 skyBlue(0.34, 0.78, 1.0);
+const vec3 sunYellow(1, 1, 0.8);
+//color of water in non-fancy mode
+const vec3 waterBlue(0.25, 0.5, 0.7);
+//color applied to water when reflect/refract from air
+const vec3 waterHue = vec3(0.6, 0.85, 0.9);
+const float waterClarity = 0.96;
+//sunlight direction
+extern vec3 sunlight;
+const float cosSunRadius = 0.998;
+//bounces before Russian roulette may end a fancy path
+const int rouletteMinBounces = 1;
+//multiply all ray contributions by this to keep image
+//brightness in a reasonable range
+const float brightnessAdjust = 5;
+
 void initRay();
+//Call fn(i) for each i in [0, n), spread over RAY_THREADS threads
+void parallelFor(int n, const std::function<void(int)>& fn);
+//Precompute the tileable water normal map (called by initRay)
+void initWaterMap();
 //if write, produce a PNG file of the framebuffer after rendering
 void render(bool write, string fname = "");
+//In fast mode, with the same camera and world as the last frame: spend
+//about a frame's time adding fancy samples to a running average of the
+//view (a new one if restart) and show it. Pixels without samples yet keep
+//the last frame's color. Returns true once the view has converged (every
+//pixel has FANCY_RAYS_PER_PIXEL samples, or is under RENDER_NOISE_TARGET)
+//and there is nothing left to add.
+bool refineFrame(bool restart);
+//Given how long the last interactive render() took, choose RAY_W and
+//RAY_H for the next one. Returns true if they changed (frameBuf is then
+//reallocated). Frames that only retraced what changed in a still view
+//(SELECTIVE_RERENDER) are not counted.
+bool fitResolution(double renderSeconds);
+//Trace the given pixels (indices into the framebuffer) of the current view
+//with up to samples paths each and store them, leaving the rest of the
+//frame as it is. Underwater sun light comes from the caustic map of the
+//last render(), which is too expensive to rebuild for a few pixels.
+void renderPixels(const vector<int>& pixels, int samples);
+//Post-process the float framebuffer to a PNG file (and a PFM file if
+//WRITE_PFM)
+void writeFrame(string fname);
+//Write RAY_W * RAY_H RGBA pixels (same layout as frameBuf) to a PNG file
+void writePNG(string fname, const byte* pixels);
+//Set up the camera basis for cameraRay from the current view (render()
+//does this at the start of each frame)
+void setupCameraRays();
+//Primary ray through (possibly fractional) pixel coordinates px, py,
+//using the camera basis that render() sets up at the start of each frame
+void cameraRay(float px, float py, vec3& origin, vec3& direction);
+//Index of the pixel whose camera ray passes closest to pos (a point, or a
+//direction if pos.w is 0) in a frame rendered with viewProj (proj * view),
+//or -1 if it is off screen
+int pixelAt(const mat4& viewProj, vec4 pos);
+//What a fast frame records about a pixel's camera ray
+struct PixelSurface
+{
+  //pixel color
+  vec3 color;
+  //first thing the ray can't see straight through: an opaque texel or a
+  //water surface (material WATER, normal of the flat surface). For sky,
+  //material is AIR, depth is infinite and pos is the ray direction.
+  vec3 pos;
+  vec3 normal;
+  Block material;
+  float depth;
+  //the ray reached an opaque surface in air, and weight is how much of
+  //the ambient light reflected there reaches the pixel
+  vec3 weight;
+  bool valid;
+};
+
+//Write color to the float framebuffer (frameBuf gets it after render()
+//post-processes the frame)
+void storePixel(int x, int y, vec3 color);
+//k = 0: grey with the same magnitude as color, k = 1: color unchanged
+vec3 desaturate(vec3 color, float k);
 //get color (light contribution) from a single ray
 vec3 trace(vec3 origin, vec3 direction, bool& exact);
 //get best non-fancy approximation of pixel color with a single ray
 vec3 traceFast(vec3 origin, vec3 direction);
-vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block& prevMat, Block& nextMat, bool& escape);
+//Follow a ray until the material changes. The ray's footprint grows by
+//spread per unit of distance, and cubes of blocks smaller than the
+//footprint are seen as their most common material (0 = exact).
+vec3 collideRay(vec3 origin, vec3 direction, ivec3& block, vec3& normal, Block& prevMat, Block& nextMat, bool& escape, float spread = 0);
+//spread of camera rays and of rays after a diffuse bounce (0 unless
+//VOXEL_LOD is set)
+float cameraSpread();
+float bounceSpread();
 vec3 waterNormal(vec3 position);
-vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence, int bounces, bool& exact);
+//sunWeight scales the sun's light if the ray is headed into it (0 after a
+//diffuse bounce, whose direct term already lit it from the sun), and u
+//(uniform in [0, 1)) decides between reflection and refraction at the ocean
+vec3 processEscapedRay(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence, int bounces, float sunWeight, float u, bool& exact);
 vec3 processEscapedRayFast(vec3 pos, vec3 direction, vec3 color, vec3 colorInfluence);
 //Is there a direct path from given position to the sun?
 //If pos is underwater, has to use monte carlo method to decide
-//Otherwise, trace direct ray and see if it hits anything
-bool visibleFromSun(vec3 pos, vec3 norm, bool air);
+//Otherwise, trace direct ray (towards toSun) and see if it hits anything
+bool visibleFromSun(vec3 pos, vec3 norm, bool air, vec3 toSun = -sunlight);
+//Fraction of the sun's light that reaches pos (0 or 1, except that with
+//soft shadows underwater points get their caustic light from caustics.hpp)
+float sunTransmittance(vec3 pos, vec3 norm, bool air, vec3 toSun = -sunlight);
+//Direction sampling for the fancy path tracer (u1, u2 uniform in [0, 1))
+//cosine-weighted direction in the hemisphere around normal (pdf cos / pi)
+vec3 sampleCosine(vec3 normal, float u1, float u2);
+//uniform direction within the sun's disc
+vec3 sampleSunCone(float u1, float u2);
 void toggleFancy();
 
 std::ostream& operator<<(std::ostream& os, vec3 v);
@@ -0,0 +1,123 @@
+#include "reproject.hpp"
+#include "player.hpp"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+
+//every pixel is traced at least once this many frames (by its position)
+#define REFRESH 8
+//and a color is never carried over for more frames than this
+#define MAX_AGE 16
+//a neighbour closer than this fraction of a pixel's depth hides it
+#define OCCLUDER_DEPTH 0.9f
+
+static vector<PixelSurface> surfaces;
+static vector<PixelSurface> last;
+//depth in the current view of the surface that landed on each pixel
+static vector<float> depths;
+//frames since each pixel's color was traced
+static vector<unsigned char> ages;
+static vector<unsigned char> lastAges;
+static vector<bool> traced;
+static bool haveLast = false;
+static int lastWorldVersion;
+static unsigned frame = 0;
+
+static bool refreshedIn(unsigned f, int x, int y)
+{
+  return (x * 3 + y * 5 + f) % REFRESH == 0;
+}
+
+//Splat the last frame into the current view (nearest surface wins)
+static void scatterLast()
+{
+  mat4 viewProj = proj * view;
+  int n = RAY_W * RAY_H;
+  std::fill(depths.begin(), depths.end(), -1.f);
+  for(int i = 0; i < n; i++)
+  {
+    const PixelSurface& s = last[i];
+    bool sky = s.material == AIR;
+    int j = pixelAt(viewProj, vec4(s.pos, sky ? 0 : 1));
+    if(j < 0)
+      continue;
+    float depth = sky ? INFINITY : glm::length(s.pos - player);
+    if(depths[j] >= 0 && depths[j] <= depth)
+      continue;
+    surfaces[j] = s;
+    depths[j] = depth;
+    ages[j] = std::min(lastAges[i] + 1, 255);
+  }
+}
+
+PixelSurface* beginReprojectFrame()
+{
+  size_t n = RAY_W * RAY_H;
+  if(surfaces.size() != n)
+  {
+    surfaces.resize(n);
+    last.resize(n);
+    depths.resize(n);
+    ages.resize(n);
+    lastAges.resize(n);
+    traced.resize(n);
+    haveLast = false;
+  }
+  frame++;
+  if(!haveLast || worldVersion() != lastWorldVersion)
+  {
+    std::fill(traced.begin(), traced.end(), true);
+    return &surfaces[0];
+  }
+  scatterLast();
+  for(int y = 0; y < RAY_H; y++)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      float depth = depths[i];
+      const PixelSurface& s = surfaces[i];
+      //sky below the horizon is the distant sea
+      bool water = s.material == WATER || (s.material == AIR && s.pos.y < 0);
+      bool trace = depth < 0 || water ||
+        ages[i] >= MAX_AGE || refreshedIn(frame, x, y);
+      //check for a neighbour that should be in front
+      for(int k = 0; k < 4 && !trace; k++)
+      {
+        int nx = x + (k == 0) - (k == 1);
+        int ny = y + (k == 2) - (k == 3);
+        if(nx < 0 || ny < 0 || nx >= RAY_W || ny >= RAY_H)
+          continue;
+        float other = depths[nx + ny * RAY_W];
+        trace = other >= 0 && other < depth * OCCLUDER_DEPTH;
+      }
+      traced[i] = trace;
+    }
+  }
+  return &surfaces[0];
+}
+
+bool reprojectTraced(int x, int y)
+{
+  return traced[x + y * RAY_W];
+}
+
+void finishReprojectFrame()
+{
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      if(traced[i])
+        ages[i] = 0;
+      storePixel(x, y, surfaces[i].color);
+    }
+  });
+  surfaces.swap(last);
+  ages.swap(lastAges);
+  lastWorldVersion = worldVersion();
+  haveLast = true;
+}
@@ -0,0 +1,28 @@
+#ifndef REPROJECT_H
+#define REPROJECT_H
+
+#include "ray.hpp"
+
+//Temporal reprojection for fast frames. Every pixel of the last frame
+//carries the world position of its surface (a direction for sky), so at
+//the start of a frame they are projected into the new view, nearest
+//surface winning where several land on the same pixel. A pixel keeps the
+//color that lands on it, and is only traced again if:
+//-nothing landed on it (it was off screen or hidden last frame),
+//-a neighbour got a surface much closer than its own (the far side of an
+// edge, where background can show through gaps in the foreground),
+//-it shows water (or the sea beyond the world), whose waves move,
+//-it is in this frame's share of a pattern that retraces every pixel
+// once every 8 frames, or its color has been carried over for 16 frames
+// (so specular highlights catch up).
+//Block edits and resolution changes start over with a full frame.
+
+//Project the last frame into the current view and return the surfaces
+//for renderPixel to fill in (RAY_W * RAY_H, row major)
+PixelSurface* beginReprojectFrame();
+//Does pixel (x, y) need to be traced this frame?
+bool reprojectTraced(int x, int y);
+//Store the frame (storePixel) and keep it for the next one
+void finishReprojectFrame();
+
+#endif
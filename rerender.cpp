@@ -0,0 +1,150 @@
+#include "rerender.hpp"
+#include "player.hpp"
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+
+//changed chunks are grown by this many blocks, since a cached hard shadow
+//is traced from the center of its face cell rather than the hit itself
+#define CHUNK_MARGIN 1
+
+struct Box
+{
+  vec3 lo;
+  vec3 hi;
+};
+
+static vector<PixelSurface> surfaces;
+static vector<char> traced;
+//chunkVersion of every chunk when the kept surfaces were last brought up
+//to date
+static int versions[chunksX][chunksY][chunksZ];
+static mat4 keptViewProj;
+static bool haveKept = false;
+static bool partial = false;
+
+bool sameView()
+{
+  static mat4 lastViewProj;
+  static int lastW = 0;
+  static int lastH = 0;
+  mat4 viewProj = proj * view;
+  bool same = viewProj == lastViewProj && RAY_W == lastW && RAY_H == lastH;
+  lastViewProj = viewProj;
+  lastW = RAY_W;
+  lastH = RAY_H;
+  return same;
+}
+
+//Does origin + t * direction, 0 <= t <= tMax, pass through box?
+static bool crosses(vec3 origin, vec3 direction, float tMax, const Box& box)
+{
+  float tNear = 0;
+  float tFar = tMax;
+  for(int i = 0; i < 3; i++)
+  {
+    if(direction[i] == 0)
+    {
+      if(origin[i] < box.lo[i] || origin[i] > box.hi[i])
+        return false;
+      continue;
+    }
+    float t0 = (box.lo[i] - origin[i]) / direction[i];
+    float t1 = (box.hi[i] - origin[i]) / direction[i];
+    tNear = fmax(tNear, fmin(t0, t1));
+    tFar = fmin(tFar, fmax(t0, t1));
+    if(tNear > tFar)
+      return false;
+  }
+  return true;
+}
+
+//Chunks whose blocks changed since the last call
+static vector<Box> changedChunks()
+{
+  vector<Box> changed;
+  for(int cx = 0; cx < chunksX; cx++)
+  {
+    for(int cy = 0; cy < chunksY; cy++)
+    {
+      for(int cz = 0; cz < chunksZ; cz++)
+      {
+        int v = chunkVersion(cx, cy, cz);
+        if(v == versions[cx][cy][cz])
+          continue;
+        versions[cx][cy][cz] = v;
+        Box box = {vec3(cx, cy, cz) * 16.f - float(CHUNK_MARGIN),
+          vec3(cx + 1, cy + 1, cz + 1) * 16.f + float(CHUNK_MARGIN)};
+        changed.push_back(box);
+      }
+    }
+  }
+  return changed;
+}
+
+PixelSurface* beginRerenderFrame()
+{
+  size_t n = RAY_W * RAY_H;
+  if(surfaces.size() != n)
+  {
+    surfaces.resize(n);
+    traced.resize(n);
+    haveKept = false;
+  }
+  vector<Box> changed = changedChunks();
+  mat4 viewProj = proj * view;
+  partial = haveKept && viewProj == keptViewProj;
+  if(!partial)
+  {
+    keptViewProj = viewProj;
+    std::fill(traced.begin(), traced.end(), 1);
+    return &surfaces[0];
+  }
+  vec3 toSun = -sunlight;
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      const PixelSurface& s = surfaces[i];
+      //water seen directly, or a surface reached through it
+      bool trace = s.material == WATER || (s.material != AIR && !s.valid);
+      if(!trace && !changed.empty())
+      {
+        vec3 origin, direction;
+        cameraRay(x, y, origin, direction);
+        //surfaces facing away from the sun don't trace a shadow ray
+        bool shadowRay = s.material != AIR && glm::dot(s.normal, toSun) >= 0;
+        for(size_t j = 0; j < changed.size() && !trace; j++)
+        {
+          trace = crosses(origin, direction, s.depth, changed[j]) ||
+            (shadowRay && crosses(s.pos, toSun, INFINITY, changed[j]));
+        }
+      }
+      traced[i] = trace;
+    }
+  });
+  return &surfaces[0];
+}
+
+bool rerenderPartial()
+{
+  return partial;
+}
+
+bool rerenderTraced(int x, int y)
+{
+  return traced[x + y * RAY_W];
+}
+
+void finishRerenderFrame()
+{
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+      storePixel(x, y, surfaces[x + y * RAY_W].color);
+  });
+  haveKept = true;
+}
@@ -0,0 +1,31 @@
+#ifndef RERENDER_H
+#define RERENDER_H
+
+#include "ray.hpp"
+
+//Selective re-rendering of fast frames while the camera stands still.
+//With the view unchanged, a pixel's color can only change if blocks along
+//its path change, or if the path involves water, whose waves move with
+//time. Away from water, a fast-mode path is a straight line from the
+//camera to the surface it hits (through transparent texels), plus a
+//straight shadow ray from there towards the sun. So each pixel's surface
+//is kept, and the next frame only traces the pixels that see water or
+//reach a surface through it, and those whose camera or shadow ray passes
+//through a chunk whose blocks changed (see chunkVersion). Every other
+//pixel keeps its color.
+
+//Is the view the same as at the last call? (render() calls this once per
+//fast frame)
+bool sameView();
+//Find the pixels that need tracing and return the surfaces for renderPixel
+//to fill in (RAY_W * RAY_H, row major). Everything is traced if the view
+//differs from the last frame this kept.
+PixelSurface* beginRerenderFrame();
+//Is this frame only tracing some of its pixels?
+bool rerenderPartial();
+//Does pixel (x, y) need to be traced this frame?
+bool rerenderTraced(int x, int y);
+//Store the frame (storePixel) and keep it for the next one
+void finishRerenderFrame();
+
+#endif
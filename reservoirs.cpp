@@ -0,0 +1,314 @@
+#include "reservoirs.hpp"
+#include "ray.hpp"
+#include "tiles.hpp"
+#include "player.hpp"
+#include "sampler.hpp"
+#include <cmath>
+#include <vector>
+#include "stdatomic.h"
+
+using std::vector;
+
+//neighbours each pixel resamples from, and how far away (in pixels) they
+//can be
+#define SPATIAL_SAMPLES 6
+#define SPATIAL_RADIUS 8
+//a reservoir inherited from the previous frame counts as at most this many
+//candidates, so old samples fade out as the view or the world changes
+#define HISTORY_CAP 20
+//samples are not reused where moving them to the new pixel changes their
+//density by more than this factor
+#define MAX_JACOBIAN 2
+//sampler slots: bounce direction and temporal choice, then each neighbour
+//takes an offset and a choice
+#define TEMPORAL_SLOTS 2
+
+const float pi = 3.14159265f;
+
+//Where a bounce ray ended: a surface point and the light leaving it, or
+//(sky) the ray's direction and the sky's light
+struct BounceSample
+{
+  vec3 pos;
+  vec3 normal;
+  vec3 light;
+  bool sky;
+};
+
+struct Reservoir
+{
+  BounceSample sample;
+  //sum of resampling weights
+  float wsum;
+  //number of candidates seen
+  float M;
+  //contribution weight of sample (an estimate of 1 / its pdf)
+  float W;
+};
+
+static vector<PixelSurface> surfaces;
+static vector<PixelSurface> lastSurfaces;
+//reservoirs after temporal reuse in this frame, and the final ones of the
+//last frame
+static vector<Reservoir> reservoirs;
+static vector<Reservoir> history;
+static mat4 lastViewProj;
+static bool haveHistory = false;
+static atomic_int historyStale;
+static unsigned frameIndex = 0;
+
+static inline float luminance(vec3 c)
+{
+  return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+static inline vec3 sampleDirection(vec3 x, const BounceSample& s)
+{
+  return s.sky ? s.pos : normalize(s.pos - x);
+}
+
+//resampling target: how much s would light surface (up to a constant)
+static inline float target(const PixelSurface& surf, const BounceSample& s)
+{
+  return luminance(s.light) * fmax(0, glm::dot(surf.normal, sampleDirection(surf.pos, s)));
+}
+
+//add a candidate with weight w standing for M candidates; returns true if
+//it replaced the reservoir's sample
+static inline bool update(Reservoir& r, const BounceSample& s, float w, float M, float u)
+{
+  r.wsum += w;
+  r.M += M;
+  if(w > 0 && u * r.wsum < w)
+  {
+    r.sample = s;
+    return true;
+  }
+  return false;
+}
+
+static inline void finalize(Reservoir& r, const PixelSurface& surf)
+{
+  float p = target(surf, r.sample);
+  r.W = p > 0 && r.M > 0 ? r.wsum / (r.M * p) : 0;
+}
+
+//Ratio of the density of s (per solid angle) seen from x to its density
+//seen from xs, the surface that sampled it
+static float jacobian(vec3 x, vec3 xs, const BounceSample& s)
+{
+  if(s.sky)
+    return 1;
+  vec3 tx = x - s.pos;
+  vec3 ts = xs - s.pos;
+  float dx2 = glm::dot(tx, tx);
+  float ds2 = glm::dot(ts, ts);
+  float cx = glm::dot(s.normal, tx);
+  float cs = glm::dot(s.normal, ts);
+  if(cx <= 0 || cs <= 0)
+    return 0;
+  return (cx / cs) * sqrtf(ds2 / dx2) * (ds2 / dx2);
+}
+
+//Follow a ray from a surface through transparent texels, like fast mode
+//does, to the first opaque texel or water surface.
+//Returns false if the ray leaves the world.
+static bool followRay(vec3 origin, vec3 direction, vec3& hit, vec3& normal, Block& mat, vec3& albedo)
+{
+  while(true)
+  {
+    ivec3 block;
+    bool escape = false;
+    Block prevMaterial;
+    hit = collideRay(origin, direction, block, normal, prevMaterial, mat, escape);
+    if(escape)
+      return false;
+    if(mat == WATER)
+    {
+      albedo = waterBlue;
+      return true;
+    }
+    vec4 texel = sample(mat, faceSide(normal), hit.x, hit.y, hit.z);
+    if(texel.w > 0.5)
+    {
+      albedo = vec3(texel);
+      return true;
+    }
+    origin = hit;
+  }
+}
+
+static BounceSample traceBounce(vec3 pos, vec3 direction)
+{
+  BounceSample s;
+  vec3 normal, albedo;
+  Block mat;
+  s.sky = !followRay(pos, direction, s.pos, normal, mat, albedo);
+  if(s.sky)
+  {
+    //the sky lights surfaces as much as the constant ambient term does
+    s.pos = direction;
+    s.normal = vec3(0, 0, 0);
+    s.light = vec3(ambient, ambient, ambient);
+    return s;
+  }
+  //shaded like a fast mode surface, without specular
+  float diffContrib = 0;
+  if(visibleFromSun(s.pos, normal, true))
+    diffContrib = materials[mat].kd * fmax(0, glm::dot(normal, -sunlight));
+  s.normal = normal;
+  s.light = (ambient + diffContrib) * albedo;
+  return s;
+}
+
+//Does nothing block the way from surf to s?
+static bool reaches(const PixelSurface& surf, const BounceSample& s)
+{
+  vec3 hit, normal, albedo;
+  Block mat;
+  bool blocked = followRay(surf.pos, sampleDirection(surf.pos, s), hit, normal, mat, albedo);
+  if(s.sky)
+    return !blocked;
+  return blocked && glm::length(hit - s.pos) < 0.01f;
+}
+
+//could reservoirs of b's pixel be reused for a?
+static bool similar(const PixelSurface& a, const PixelSurface& b)
+{
+  return b.valid && glm::dot(a.normal, b.normal) > 0.9f &&
+    fabsf(glm::dot(a.normal, b.pos - a.pos)) < 0.05f;
+}
+
+//pixel that saw surf in the last frame, or -1
+static int reproject(const PixelSurface& surf)
+{
+  int i = pixelAt(lastViewProj, vec4(surf.pos, 1));
+  return i >= 0 && similar(surf, lastSurfaces[i]) ? i : -1;
+}
+
+//new candidate, then the pixel's reservoir from the last frame
+static void temporalReuse(int i, unsigned frame, bool useHistory)
+{
+  const PixelSurface& surf = surfaces[i];
+  Reservoir& r = reservoirs[i];
+  r.wsum = 0;
+  r.M = 0;
+  r.W = 0;
+  if(!surf.valid)
+    return;
+  Sampler sampler;
+  sampler.start(i, frame);
+  vec2 u = sampler.get2D();
+  BounceSample fresh = traceBounce(surf.pos, sampleCosine(surf.normal, u.x, u.y));
+  r.sample = fresh;
+  //the bounce direction's pdf is cos / pi, so its weight is pi * luminance
+  update(r, fresh, pi * luminance(fresh.light), 1, 0);
+  Reservoir own = r;
+  float choice = sampler.get1D();
+  int j = useHistory ? reproject(surf) : -1;
+  if(j >= 0 && history[j].M > 0)
+  {
+    const Reservoir& prev = history[j];
+    float M = fmin(prev.M, HISTORY_CAP);
+    float J = jacobian(surf.pos, lastSurfaces[j].pos, prev.sample);
+    if(J < MAX_JACOBIAN && J * MAX_JACOBIAN > 1 &&
+        update(r, prev.sample, target(surf, prev.sample) * prev.W * M * J, M, choice) &&
+        !reaches(surf, r.sample))
+    {
+      r = own;
+    }
+  }
+  finalize(r, surf);
+}
+
+//resample reservoirs of neighbouring pixels, then shade
+static void spatialReuse(int i, unsigned frame)
+{
+  PixelSurface& surf = surfaces[i];
+  int x = i % RAY_W;
+  int y = i / RAY_W;
+  Reservoir& result = history[i];
+  if(!surf.valid)
+  {
+    result.M = 0;
+    storePixel(x, y, surf.color);
+    return;
+  }
+  const Reservoir& own = reservoirs[i];
+  Reservoir r;
+  r.wsum = 0;
+  r.M = 0;
+  r.sample = own.sample;
+  update(r, own.sample, target(surf, own.sample) * own.W * own.M, own.M, 0);
+  bool reused = false;
+  Sampler sampler;
+  sampler.start(i, frame);
+  sampler.dim = TEMPORAL_SLOTS;
+  for(int k = 0; k < SPATIAL_SAMPLES; k++)
+  {
+    vec2 offset = sampler.get2D();
+    float choice = sampler.get1D();
+    float angle = 2 * pi * offset.x;
+    float radius = SPATIAL_RADIUS * sqrtf(offset.y);
+    int nx = x + (int) roundf(radius * cosf(angle));
+    int ny = y + (int) roundf(radius * sinf(angle));
+    if(nx < 0 || ny < 0 || nx >= RAY_W || ny >= RAY_H)
+      continue;
+    int j = nx + ny * RAY_W;
+    const Reservoir& q = reservoirs[j];
+    if(j == i || q.M == 0 || !similar(surf, surfaces[j]))
+      continue;
+    float J = jacobian(surf.pos, surfaces[j].pos, q.sample);
+    if(J >= MAX_JACOBIAN || J * MAX_JACOBIAN <= 1)
+      continue;
+    if(update(r, q.sample, target(surf, q.sample) * q.W * q.M * J, q.M, choice))
+      reused = true;
+  }
+  finalize(r, surf);
+  if(reused && !reaches(surf, r.sample))
+    r = own;
+  result = r;
+  //light arriving at surf, in the same units as ambient
+  float cosTheta = fmax(0, glm::dot(surf.normal, sampleDirection(surf.pos, r.sample)));
+  vec3 bounce = r.sample.light * (cosTheta * r.W / pi);
+  storePixel(x, y, surf.color + surf.weight * (bounce - vec3(ambient, ambient, ambient)));
+}
+
+PixelSurface* beginBounceFrame()
+{
+  size_t n = RAY_W * RAY_H;
+  if(surfaces.size() != n)
+  {
+    surfaces.resize(n);
+    lastSurfaces.resize(n);
+    reservoirs.resize(n);
+    history.resize(n);
+    haveHistory = false;
+  }
+  return &surfaces[0];
+}
+
+void resolveBounceLight()
+{
+  bool useHistory = haveHistory && !atomic_exchange(&historyStale, 0);
+  unsigned frame = frameIndex++;
+  //neighbours' reservoirs have to be complete before spatial reuse
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+      temporalReuse(x + y * RAY_W, frame, useHistory);
+  });
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+      spatialReuse(x + y * RAY_W, frame);
+  });
+  surfaces.swap(lastSurfaces);
+  lastViewProj = proj * view;
+  haveHistory = true;
+}
+
+void invalidateReservoirs()
+{
+  atomic_store(&historyStale, 1);
+}
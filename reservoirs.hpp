@@ -0,0 +1,27 @@
+#ifndef RESERVOIRS_H
+#define RESERVOIRS_H
+
+#include "ray.hpp"
+
+//One-bounce diffuse light for fast mode, from per-pixel reservoirs
+//(ReSTIR GI, Ouyang et al. 2021).
+//Fast mode normally lights every surface with the constant ambient term.
+//With BOUNCE_LIGHT, the ambient term of each pixel's first surface is
+//replaced by the light arriving there after one diffuse bounce: the sky
+//(at the ambient level), or another surface lit by the sun and ambient.
+//Each frame a pixel traces a single cosine-weighted bounce ray. Its result
+//is resampled together with the pixel's reservoir from the previous frame
+//(found by reprojection) and then with reservoirs of nearby pixels on
+//similar surfaces, so a pixel effectively sees many bounce samples for the
+//price of one. A reused sample is only kept if a ray from the pixel's
+//surface still reaches it.
+
+//Size the per-pixel buffers for the current frame and return the surfaces
+//for renderPixel to fill in (RAY_W * RAY_H, row major)
+PixelSurface* beginBounceFrame();
+//Add bounce light to the surfaces' colors and store them (storePixel)
+void resolveBounceLight();
+//Drop the reservoirs of previous frames (called when blocks change)
+void invalidateReservoirs();
+
+#endif
@@ -0,0 +1,83 @@
+#include "sampler.hpp"
+
+static inline unsigned hashInt(unsigned x)
+{
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline unsigned hashCombine(unsigned seed, unsigned v)
+{
+  return seed ^ (v + (seed << 6) + (seed >> 2));
+}
+
+static inline unsigned reverseBits(unsigned x)
+{
+  x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+  x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+  x = ((x >> 8) & 0x00FF00FF) | ((x & 0x00FF00FF) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+//Owen scrambling of the bits of x (Laine-Karras style hash on the
+//reversed bits, so each bit only depends on the ones above it)
+static inline unsigned owenScramble(unsigned x, unsigned seed)
+{
+  x = reverseBits(x);
+  x += seed;
+  x ^= x * 0x6c50b47c;
+  x ^= x * 0xb82f1e52;
+  x ^= x * 0xc7afe638;
+  x ^= x * 0x8d22f6e6;
+  return reverseBits(x);
+}
+
+//first two dimensions of the Sobol sequence
+static inline unsigned sobol0(unsigned i)
+{
+  return reverseBits(i);
+}
+
+static inline unsigned sobol1(unsigned i)
+{
+  unsigned r = 0;
+  for(unsigned v = 1u << 31; i; i >>= 1, v ^= v >> 1)
+  {
+    if(i & 1)
+      r ^= v;
+  }
+  return r;
+}
+
+static inline float toUnit(unsigned x)
+{
+  return (x >> 8) * (1.0f / (1 << 24));
+}
+
+void Sampler::start(unsigned pixel, unsigned sample)
+{
+  seed = hashInt(pixel * 0x9e3779b9 + 0x632be5ab);
+  index = sample;
+  dim = 0;
+}
+
+float Sampler::get1D()
+{
+  unsigned slotSeed = hashInt(hashCombine(seed, dim++));
+  unsigned i = owenScramble(index, slotSeed);
+  return toUnit(owenScramble(sobol0(i), hashInt(slotSeed)));
+}
+
+vec2 Sampler::get2D()
+{
+  unsigned slotSeed = hashInt(hashCombine(seed, dim++));
+  unsigned i = owenScramble(index, slotSeed);
+  unsigned x = owenScramble(sobol0(i), hashInt(slotSeed));
+  unsigned y = owenScramble(sobol1(i), hashInt(slotSeed + 1));
+  return vec2(toUnit(x), toUnit(y));
+}
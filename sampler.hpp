@@ -0,0 +1,25 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "glmHeaders.hpp"
+
+//Low-discrepancy sample streams for the fancy path tracer.
+//Every pixel gets its own Owen-scrambled Sobol sequence, and sample n of
+//the pixel uses point n of it, so the first N samples of a pixel are
+//stratified for any N (best at powers of two).
+//Each dimension slot is one 1D or 2D point from the first two Sobol
+//dimensions, with the sample order shuffled per slot (Burley 2020), so
+//slots stay independent of each other however many a path uses.
+struct Sampler
+{
+  unsigned seed;
+  unsigned index;
+  //next dimension slot
+  unsigned dim;
+  void start(unsigned pixel, unsigned sample);
+  //values in [0, 1)
+  float get1D();
+  vec2 get2D();
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include "shadows.hpp"
+#include "ray.hpp"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <pthread.h>
+#include "stdatomic.h"
+
+//buckets of SHADOW_WAYS faces, a new face replaces the bucket's least used one if the bucket is full
+#define SHADOW_BUCKETS (1 << 15)
+#define SHADOW_WAYS 4
+#define SHADOW_LOCKS 256
+//bits per face, in 64-bit words
+#define SHADOW_WORDS (SHADOW_CACHE_RES * SHADOW_CACHE_RES / 64)
+
+struct FaceShadows
+{
+  unsigned long long key;
+  //generation + 1 when the face was added (so zeroed faces are empty)
+  int generation;
+  int uses;
+  //cells whose visibility is known, and which of those are lit
+  unsigned long long known[SHADOW_WORDS];
+  unsigned long long lit[SHADOW_WORDS];
+};
+
+static FaceShadows faces[SHADOW_BUCKETS][SHADOW_WAYS];
+static pthread_mutex_t locks[SHADOW_LOCKS];
+static pthread_once_t locksOnce = PTHREAD_ONCE_INIT;
+static atomic_int generation;
+
+static void initLocks()
+{
+  for(int i = 0; i < SHADOW_LOCKS; i++)
+    pthread_mutex_init(&locks[i], NULL);
+}
+
+//Find the face containing pos: key packs the block behind the face and
+//which of its 6 faces it is, cell is the index within the face
+static void locate(vec3 pos, vec3 normal, unsigned long long& key, int& cell)
+{
+  int axis = fabsf(normal.x) > 0.5f ? 0 : (fabsf(normal.y) > 0.5f ? 1 : 2);
+  bool positive = normal[axis] > 0;
+  int block[3];
+  int uv[2];
+  int c = 0;
+  for(int i = 0; i < 3; i++)
+  {
+    if(i == axis)
+    {
+      block[i] = (int) roundf(pos[i]) - (positive ? 1 : 0);
+    }
+    else
+    {
+      float b = floorf(pos[i]);
+      block[i] = (int) b;
+      uv[c++] = std::min(int((pos[i] - b) * SHADOW_CACHE_RES), SHADOW_CACHE_RES - 1);
+    }
+  }
+  key = 0;
+  for(int i = 0; i < 3; i++)
+    key = (key << 16) | (unsigned short) block[i];
+  key = (key << 3) | (axis * 2 + positive);
+  cell = uv[0] * SHADOW_CACHE_RES + uv[1];
+}
+
+static inline unsigned bucketOf(unsigned long long key)
+{
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return (unsigned) key & (SHADOW_BUCKETS - 1);
+}
+
+bool lookupShadow(vec3 pos, vec3 normal, bool& lit)
+{
+  pthread_once(&locksOnce, initLocks);
+  unsigned long long key;
+  int cell;
+  locate(pos, normal, key, cell);
+  unsigned b = bucketOf(key);
+  int gen = atomic_load(&generation) + 1;
+  unsigned long long bit = 1ULL << (cell % 64);
+  bool found = false;
+  pthread_mutex_t* lock = &locks[b % SHADOW_LOCKS];
+  pthread_mutex_lock(lock);
+  for(int i = 0; i < SHADOW_WAYS; i++)
+  {
+    FaceShadows& face = faces[b][i];
+    if(face.generation == gen && face.key == key)
+    {
+      if(face.known[cell / 64] & bit)
+      {
+        lit = (face.lit[cell / 64] & bit) != 0;
+        face.uses++;
+        found = true;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(lock);
+  return found;
+}
+
+vec3 shadowCellCenter(vec3 pos, vec3 normal)
+{
+  for(int i = 0; i < 3; i++)
+  {
+    if(fabsf(normal[i]) > 0.5f)
+      pos[i] = roundf(pos[i]);
+    else
+    {
+      //same cell as locate
+      float b = floorf(pos[i]);
+      int cell = std::min(int((pos[i] - b) * SHADOW_CACHE_RES), SHADOW_CACHE_RES - 1);
+      pos[i] = b + (cell + 0.5f) / SHADOW_CACHE_RES;
+    }
+  }
+  return pos;
+}
+
+int shadowGeneration()
+{
+  return atomic_load(&generation);
+}
+
+void storeShadow(vec3 pos, vec3 normal, bool lit, int traced)
+{
+  pthread_once(&locksOnce, initLocks);
+  unsigned long long key;
+  int cell;
+  locate(pos, normal, key, cell);
+  unsigned b = bucketOf(key);
+  //the faces are stored under the generation the ray was traced in, so
+  //if the cache is invalidated while this waits for the lock, the result
+  //is dropped along with everything else
+  int gen = traced + 1;
+  if(atomic_load(&generation) != traced)
+    return;
+  pthread_mutex_t* lock = &locks[b % SHADOW_LOCKS];
+  pthread_mutex_lock(lock);
+  FaceShadows* victim = NULL;
+  for(int i = 0; i < SHADOW_WAYS; i++)
+  {
+    FaceShadows& face = faces[b][i];
+    if(face.generation == gen && face.key == key)
+    {
+      victim = &face;
+      break;
+    }
+    if(face.generation != gen)
+    {
+      if(!victim || victim->generation == gen)
+        victim = &face;
+    }
+    else if(!victim || (victim->generation == gen && face.uses < victim->uses))
+    {
+      victim = &face;
+    }
+  }
+  if(victim->generation != gen || victim->key != key)
+  {
+    memset(victim, 0, sizeof(FaceShadows));
+    victim->key = key;
+    victim->generation = gen;
+  }
+  unsigned long long bit = 1ULL << (cell % 64);
+  victim->known[cell / 64] |= bit;
+  if(lit)
+    victim->lit[cell / 64] |= bit;
+  pthread_mutex_unlock(lock);
+}
+
+void invalidateShadowsThrough(int x, int y, int z)
+{
+  pthread_once(&locksOnce, initLocks);
+  int gen = atomic_load(&generation) + 1;
+  vec3 toSun = -sunlight;
+  vec3 changed(x + 0.5f, y + 0.5f, z + 0.5f);
+  //a ray from a face (radius sqrt(2)/2 around its center) can touch the
+  //block (radius sqrt(3)/2 around its center) if the line through the
+  //centers along the sun direction passes within the sum of the radii
+  const float reach = 0.7072f + 0.8661f;
+  for(int b = 0; b < SHADOW_BUCKETS; b++)
+  {
+    pthread_mutex_t* lock = &locks[b % SHADOW_LOCKS];
+    pthread_mutex_lock(lock);
+    for(int i = 0; i < SHADOW_WAYS; i++)
+    {
+      FaceShadows& face = faces[b][i];
+      if(face.generation != gen)
+        continue;
+      //unpack the face's block and side (see locate)
+      unsigned long long key = face.key;
+      int side = (key & 7);
+      int axis = side / 2;
+      vec3 center;
+      center.z = (short) ((key >> 3) & 0xFFFF);
+      center.y = (short) ((key >> 19) & 0xFFFF);
+      center.x = (short) ((key >> 35) & 0xFFFF);
+      center += vec3(0.5f, 0.5f, 0.5f);
+      center[axis] += side % 2 ? 0.5f : -0.5f;
+      vec3 w = changed - center;
+      float along = glm::dot(w, toSun);
+      if(along > -reach && glm::length(w - along * toSun) < reach)
+        face.generation = 0;
+    }
+    pthread_mutex_unlock(lock);
+  }
+}
+
+void invalidateShadows()
+{
+  atomic_fetch_add(&generation, 1);
+}
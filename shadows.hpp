@@ -0,0 +1,30 @@
+#ifndef SHADOWS_H
+#define SHADOWS_H
+
+#include "glmHeaders.hpp"
+
+//Cache of hard-shadow sun visibility on block faces.
+//Every face is split into SHADOW_CACHE_RES x SHADOW_CACHE_RES cells (one
+//per texel), filled lazily: the first shadow test that lands in a cell
+//traces a ray to the sun from the cell's center, and later tests in the
+//same cell reuse its result. The sun never moves, so entries only go stale
+//when blocks change: setBlock drops the faces whose sun rays could pass
+//through the changed block, and publishing terrain drops everything.
+#define SHADOW_CACHE_RES 16
+
+//pos is a point on a block face with axis-aligned normal.
+//Returns true and sets lit if the cell's visibility is known.
+bool lookupShadow(vec3 pos, vec3 normal, bool& lit);
+//Center of the cell containing pos, where its shadow ray should start
+vec3 shadowCellCenter(vec3 pos, vec3 normal);
+//Current generation of the cache, to be read before tracing a shadow ray
+int shadowGeneration();
+//Store a result traced from the world as it was at generation (dropped
+//if the cache has been invalidated since)
+void storeShadow(vec3 pos, vec3 normal, bool lit, int generation);
+//Forget faces that the sun reaches through block (x, y, z)
+void invalidateShadowsThrough(int x, int y, int z);
+//Forget everything
+void invalidateShadows();
+
+#endif
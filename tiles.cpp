@@ -2,14 +2,29 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-static int atlasW;
-static int atlasH;
-static unsigned char* image;
+//The atlas is repacked at load time into one contiguous 16x16 tile of
+//float texels per distinct face texture, so a fetch reads one 16-byte
+//texel, along with a bitmask of the tile's opaque texels for alpha tests
+struct Tile
+{
+  vec4 texels[16][16];
+  //bit tx of opaque[ty] is set if texel (tx, ty) has alpha > 0.5
+  unsigned short opaque[16];
+};
+
+static Tile* tiles;
+//index into tiles for each (side, block)
+static int tileIndex[3][NUM_TILES];
+
+float ipart(float);
+float fpart(float);
 
 void initAtlas()
 {
+  int atlasW;
+  int atlasH;
   int components = 0;
-  image = stbi_load("../atlas.png", &atlasW, &atlasH, &components, 0);
+  unsigned char* image = stbi_load("../atlas.png", &atlasW, &atlasH, &components, 0);
   if(!image)
   {
     puts("Failed to load textuer atlas");
@@ -20,161 +35,61 @@ void initAtlas()
     puts("Error: texture atlas must have 4 color components (8-bit RGBA)");
     exit(1);
   }
-}
-
-/*
-  AIR,
-  STONE,
-  DIRT,
-  COAL,
-  IRON,
-  GOLD,
-  DIAMOND,
-  LOG,
-  LEAF,
-  WATER,
-  SAND,
-  GLASS,
-  OBSIDIAN,
-  QUARTZ,
-  BEDROCK
-*/
-
-//top, side, and bottom texture coordinates for each block
-
-static int texcoords[3][NUM_TILES][2] =
-{
-  //Top textures
-  {
-    {16, 112},//AIR (no texture)
-    {16, 0},  //STONE
-    {0, 0},   //GRASS
-    {32, 32}, //COAL
-    {16, 32}, //IRON
-    {0, 32},  //GOLD
-    {32, 48}, //DIAMOND
-    {80, 16}, //LOG
-    {64, 48}, //LEAF
-    {16, 112},//WATER (no texture)
-    {32, 16}, //SAND
-    {16, 48}, //GLASS
-    {80, 32}, //OBSIDIAN
-    {32, 64}, //QUARTZ
-    {16, 16}, //BEDROCK
-    {0, 0}
-  },
-  //Side textures
+  //faces often share a texture, so only copy each distinct tile once
+  tiles = new Tile[3 * NUM_TILES];
+  int numTiles = 0;
+  for(int side = 0; side < 3; side++)
   {
-    {16, 112},//AIR (no texture)
-    {16, 0},  //STONE
-    {48, 0},  //GRASS
-    {32, 32}, //COAL
-    {16, 32}, //IRON
-    {0, 32},  //GOLD
-    {32, 48}, //DIAMOND
-    {64, 16}, //LOG
-    {64, 48}, //LEAF
-    {16, 112},//WATER (no texture)
-    {32, 16}, //SAND
-    {16, 48}, //GLASS
-    {80, 32}, //OBSIDIAN
-    {32, 64}, //QUARTZ
-    {16, 16}, //BEDROCK
-    {0, 0}
-  },
-  //Bottom textures
-  {
-    {16, 112},//AIR (no texture)
-    {16, 0},  //STONE
-    {32, 0},  //GRASS
-    {32, 32}, //COAL
-    {16, 32}, //IRON
-    {0, 32},  //GOLD
-    {32, 48}, //DIAMOND
-    {80, 16}, //LOG
-    {64, 48}, //LEAF
-    {16, 112},//WATER (no texture)
-    {32, 16}, //SAND
-    {16, 48}, //GLASS
-    {80, 32}, //OBSIDIAN
-    {32, 64}, //QUARTZ
-    {16, 16}, //BEDROCK
-    {0, 0}
+    for(int block = 0; block < NUM_TILES; block++)
+    {
+      int ox = materials[block].tex[side][0];
+      int oy = materials[block].tex[side][1];
+      int existing = -1;
+      for(int s = 0; s <= side && existing < 0; s++)
+      {
+        for(int b = 0; b < (s == side ? block : NUM_TILES); b++)
+        {
+          if(materials[b].tex[s][0] == ox && materials[b].tex[s][1] == oy)
+          {
+            existing = tileIndex[s][b];
+            break;
+          }
+        }
+      }
+      if(existing >= 0)
+      {
+        tileIndex[side][block] = existing;
+        continue;
+      }
+      Tile& tile = tiles[numTiles];
+      for(int ty = 0; ty < 16; ty++)
+      {
+        tile.opaque[ty] = 0;
+        for(int tx = 0; tx < 16; tx++)
+        {
+          unsigned char* pixel = &image[4 * ((ox + tx) + (oy + ty) * atlasW)];
+          vec4& color = tile.texels[ty][tx];
+          color.x = pixel[0] / 255.0f;
+          color.y = pixel[1] / 255.0f;
+          color.z = pixel[2] / 255.0f;
+          color.w = pixel[3] / 255.0f;
+          if(color.w > 0.5)
+            tile.opaque[ty] |= 1 << tx;
+        }
+      }
+      tileIndex[side][block] = numTiles++;
+    }
   }
-};
-
-float kd[NUM_TILES] =
-{
-  0,        //AIR
-  0.4,      //STONE
-  0.3,      //DIRT
-  0.4,      //COAL
-  0.5,      //IRON
-  0.5,      //GOLD
-  0.5,      //DIAMOND
-  0.3,      //LOG
-  0.3,      //LEAF
-  0.6,      //WATER
-  0.3,      //SAND
-  0.2,      //GLASS
-  0.2,      //OBSIDIAN
-  0.2,      //QUARTZ
-  0.0,      //BEDROCK
-  0.0       //unused
-};
-
-float ks[NUM_TILES] =
-{
-  0,        //AIR
-  0.05,     //STONE
-  0.0,      //DIRT
-  0.1,      //COAL
-  0.1,      //IRON
-  0.1,      //GOLD
-  0.1,      //DIAMOND
-  0.0,      //LOG
-  0.0,      //LEAF
-  1.0,      //WATER
-  0.05,     //SAND
-  0.5,      //GLASS
-  0.2,      //OBSIDIAN
-  0.2,      //QUARTZ
-  0.0,      //BEDROCK
-  0.0       //unused
-};
-
-//note: values for opaque blocks are never used
-float refractIndex[NUM_TILES] = 
-{
-  1,        //AIR
-  1,
-  1,
-  1,
-  1,
-  1,
-  2.417,    //DIAMOND
-  1,
-  1,
-  1.333,    //WATER
-  1,
-  1.517,    //GLASS
-  1.5,      //OBSIDIAN
-  1.46,     //QUARTZ
-  1,
-  1
-};
-
-float ipart(float);
-float fpart(float);
+  stbi_image_free(image);
+}
 
-vec4 sample(Block block, Side side, float x, float y, float z)
+//Find the texel within a face's tile for the point (x, y, z) on the face
+static inline void tileTexel(Side side, float x, float y, float z, int& tx, int& ty)
 {
   x = fpart(x);
   y = 1 - fpart(y);
   z = fpart(z);
   float eps = 1e-8;
-  int tx = 0;
-  int ty = 0;
   if(x < eps && side == SIDE)
   {
     //z,y give texcoords
@@ -193,21 +108,23 @@ vec4 sample(Block block, Side side, float x, float y, float z)
     tx = x * 16;
     ty = z * 16;
   }
-  //(tx, ty) gives offset with tile, so add tile coordinate
-  tx += texcoords[side][block][0];
-  ty += texcoords[side][block][1];
-  //sample texture
-  vec4 color;
-  unsigned char* pixel = &image[4 * (tx + ty * atlasW)];
-  color.x = pixel[0] / 255.0f;
-  color.y = pixel[1] / 255.0f;
-  color.z = pixel[2] / 255.0f;
-  color.w = pixel[3] / 255.0f;
-  return color;
+  //y is in (0, 1], so the bottom edge of a side face would land one
+  //row past the tile
+  if(ty > 15)
+    ty = 15;
+}
+
+vec4 sample(Block block, Side side, float x, float y, float z)
+{
+  int tx, ty;
+  tileTexel(side, x, y, z, tx, ty);
+  return tiles[tileIndex[side][block]].texels[ty][tx];
 }
 
-bool isTransparent(Block block)
+bool opaqueTexel(Block block, Side side, float x, float y, float z)
 {
-  return block == AIR || block == LEAF || block == WATER || block == GLASS;
+  int tx, ty;
+  tileTexel(side, x, y, z, tx, ty);
+  return (tiles[tileIndex[side][block]].opaque[ty] >> tx) & 1;
 }
 
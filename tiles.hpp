@@ -32,12 +32,67 @@ enum
 typedef unsigned char byte;
 typedef byte Block;
 
-//Specular coefficients
-extern float ks[NUM_TILES];
-//Diffuse coefficients
-extern float kd[NUM_TILES];
-//Indices of refraction
-extern float refractIndex[NUM_TILES];
+//Per-material constants, known at compile time so that the trace kernels
+//can fold them into their hit shading
+struct Material
+{
+  //light can pass through (some texels of) the block
+  bool transparent;
+  //index of refraction (values for opaque blocks are never used)
+  float ior;
+  //specular coefficient
+  float ks;
+  //diffuse coefficient
+  float kd;
+  //top, side, and bottom texture coordinates in the atlas
+  int tex[3][2];
+};
+
+constexpr Material materials[NUM_TILES] =
+{
+  //transparent, ior, ks, kd, {top, side, bottom}
+  {true,  1,     0,    0,   {{16, 112}, {16, 112}, {16, 112}}}, //AIR (no texture)
+  {false, 1,     0.05, 0.4, {{16, 0},   {16, 0},   {16, 0}}},   //STONE
+  {false, 1,     0.0,  0.3, {{0, 0},    {48, 0},   {32, 0}}},   //DIRT (grass)
+  {false, 1,     0.1,  0.4, {{32, 32},  {32, 32},  {32, 32}}},  //COAL
+  {false, 1,     0.1,  0.5, {{16, 32},  {16, 32},  {16, 32}}},  //IRON
+  {false, 1,     0.1,  0.5, {{0, 32},   {0, 32},   {0, 32}}},   //GOLD
+  {false, 2.417, 0.1,  0.5, {{32, 48},  {32, 48},  {32, 48}}},  //DIAMOND
+  {false, 1,     0.0,  0.3, {{80, 16},  {64, 16},  {80, 16}}},  //LOG
+  {true,  1,     0.0,  0.3, {{64, 48},  {64, 48},  {64, 48}}},  //LEAF
+  {true,  1.333, 1.0,  0.6, {{16, 112}, {16, 112}, {16, 112}}}, //WATER (no texture)
+  {false, 1,     0.05, 0.3, {{32, 16},  {32, 16},  {32, 16}}},  //SAND
+  {true,  1.517, 0.5,  0.2, {{16, 48},  {16, 48},  {16, 48}}},  //GLASS
+  {false, 1.5,   0.2,  0.2, {{80, 32},  {80, 32},  {80, 32}}},  //OBSIDIAN
+  {false, 1.46,  0.2,  0.2, {{32, 64},  {32, 64},  {32, 64}}},  //QUARTZ
+  {false, 1,     0.0,  0.0, {{16, 16},  {16, 16},  {16, 16}}},  //BEDROCK
+  {false, 1,     0.0,  0.0, {{0, 0},    {0, 0},    {0, 0}}}     //unused
+};
+
+//Schlick's reflectance at normal incidence between indices n1 and n2
+constexpr float schlickR0(float n1, float n2)
+{
+  return ((n1 - n2) / (n1 + n2)) * ((n1 - n2) / (n1 + n2));
+}
+
+#define R0(a, b) schlickR0(materials[a].ior, materials[b].ior)
+#define R0_ROW(a) {R0(a, 0), R0(a, 1), R0(a, 2), R0(a, 3), R0(a, 4), R0(a, 5), R0(a, 6), R0(a, 7), \
+  R0(a, 8), R0(a, 9), R0(a, 10), R0(a, 11), R0(a, 12), R0(a, 13), R0(a, 14), R0(a, 15)}
+
+//fresnelR0[a][b]: Schlick r0 for a ray passing from material a into material b
+constexpr float fresnelR0[NUM_TILES][NUM_TILES] =
+{
+  R0_ROW(0), R0_ROW(1), R0_ROW(2), R0_ROW(3), R0_ROW(4), R0_ROW(5), R0_ROW(6), R0_ROW(7),
+  R0_ROW(8), R0_ROW(9), R0_ROW(10), R0_ROW(11), R0_ROW(12), R0_ROW(13), R0_ROW(14), R0_ROW(15)
+};
+
+#undef R0_ROW
+#undef R0
+
+constexpr bool isTransparent(Block block)
+{
+  return materials[block].transparent;
+}
 
 enum Side
 {
@@ -48,9 +103,20 @@ enum Side
 
 void initAtlas();
 
+//Which texture a block face uses, given the face normal
+inline Side faceSide(vec3 normal)
+{
+  if(normal.y > 0)
+    return TOP;
+  else if(normal.y < 0)
+    return BOTTOM;
+  return SIDE;
+}
+
 //Get the color of fragment at world position x, y, z
 vec4 sample(Block block, Side side, float x, float y, float z);
-bool isTransparent(Block block);
+//Is the fragment at world position x, y, z opaque (alpha > 0.5)?
+bool opaqueTexel(Block block, Side side, float x, float y, float z);
 
 #endif
 
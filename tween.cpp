@@ -0,0 +1,259 @@
+#include "tween.hpp"
+#include "post.hpp"
+#include "wavefront.hpp"
+#include "player.hpp"
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+//paths traced for each pixel the rendered frames don't cover
+#define HOLE_SAMPLES 16
+//half the size of a pixel's square when splatted at the same depth
+//(a bit over half a pixel, so the squares of a resampled surface overlap)
+#define FOOTPRINT 0.75f
+//surfaces whose depths differ by less than this fraction are the same
+#define SAME_DEPTH 0.05f
+//points further than this from a plane aren't on it
+#define PLANE_DISTANCE 0.02f
+//a pixel between two neighbours nearer than this fraction of its depth
+//is a gap in a magnified surface, where the background shows through
+#define GAP_DEPTH 0.9f
+
+void captureFrame(TweenFrame& frame)
+{
+  int n = RAY_W * RAY_H;
+  frame.color.assign(hdrBuf, hdrBuf + n);
+  frame.pos.resize(n);
+  frame.normal.assign(frameFeatures.normal.begin(), frameFeatures.normal.end());
+  frame.depth.resize(n);
+  frame.viewProj = proj * view;
+  parallelFor(RAY_H, [&](int y)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      vec3 origin, direction;
+      cameraRay(x, y, origin, direction);
+      float depth = frameFeatures.depth[i];
+      if(frameFeatures.material[i] == AIR)
+      {
+        frame.pos[i] = vec4(direction, 0);
+        frame.depth[i] = INFINITY;
+      }
+      else
+      {
+        frame.pos[i] = vec4(player + direction * depth, 1);
+        frame.depth[i] = depth;
+      }
+    }
+  });
+}
+
+//For each pixel of the current view, the pixel of src whose surface lands
+//on it, nearest first (-1 where none does), and its depth. A surface that
+//is now closer covers more than one pixel, so each pixel of src is drawn
+//as a square scaled by how much closer it got.
+static void splat(const TweenFrame& src, const mat4& viewProj, vector<int>& hit, vector<float>& depth)
+{
+  int n = RAY_W * RAY_H;
+  hit.assign(n, -1);
+  depth.assign(n, INFINITY);
+  //squared distance from the pixel to where the kept sample landed
+  vector<float> offset(n);
+  for(int i = 0; i < n; i++)
+  {
+    vec4 clip = viewProj * src.pos[i];
+    if(clip.w <= 0)
+      continue;
+    float px = (clip.x / clip.w + 1) * 0.5f * RAY_W;
+    float py = (clip.y / clip.w + 1) * 0.5f * RAY_H;
+    float d = INFINITY;
+    float radius = FOOTPRINT;
+    if(src.pos[i].w != 0)
+    {
+      d = glm::length(vec3(src.pos[i]) - player);
+      radius *= fmax(1, src.depth[i] / d);
+    }
+    int x0 = std::max<int>(ceilf(px - radius), 0);
+    int x1 = std::min<int>(floorf(px + radius), RAY_W - 1);
+    int y0 = std::max<int>(ceilf(py - radius), 0);
+    int y1 = std::min<int>(floorf(py + radius), RAY_H - 1);
+    for(int y = y0; y <= y1; y++)
+    {
+      for(int x = x0; x <= x1; x++)
+      {
+        int j = x + y * RAY_W;
+        float dist = (x - px) * (x - px) + (y - py) * (y - py);
+        //of the samples on one surface, keep the one closest to the pixel
+        if(hit[j] >= 0 && (depth[j] < d * (1 - SAME_DEPTH) ||
+              (depth[j] <= d * (1 + SAME_DEPTH) && offset[j] <= dist)))
+          continue;
+        hit[j] = i;
+        depth[j] = d;
+        offset[j] = dist;
+      }
+    }
+  }
+}
+
+//Color of src where the camera ray (origin, direction) meets the surface
+//of src's pixel i. Voxel faces are flat, so the point is on the plane of
+//that pixel's hit, and where it lands in src is filtered bilinearly from
+//the pixels around it that are on the same plane.
+static vec3 resample(const TweenFrame& src, int i, vec3 origin, vec3 direction)
+{
+  vec4 pos = src.pos[i];
+  vec3 normal = src.normal[i];
+  if(pos.w != 0)
+  {
+    float facing = glm::dot(direction, normal);
+    if(fabsf(facing) < 1e-3f)
+      return src.color[i];
+    float t = glm::dot(vec3(pos) - origin, normal) / facing;
+    pos = vec4(origin + direction * t, 1);
+  }
+  else
+    pos = vec4(direction, 0);
+  vec4 clip = src.viewProj * pos;
+  if(clip.w <= 0)
+    return src.color[i];
+  float sx = (clip.x / clip.w + 1) * 0.5f * RAY_W;
+  float sy = (clip.y / clip.w + 1) * 0.5f * RAY_H;
+  int x0 = floorf(sx);
+  int y0 = floorf(sy);
+  float fx = sx - x0;
+  float fy = sy - y0;
+  vec3 sum(0, 0, 0);
+  float weight = 0;
+  for(int k = 0; k < 4; k++)
+  {
+    int x = x0 + (k & 1);
+    int y = y0 + (k >> 1);
+    if(x < 0 || y < 0 || x >= RAY_W || y >= RAY_H)
+      continue;
+    int j = x + y * RAY_W;
+    bool samePlane = src.pos[j].w == pos.w && (pos.w == 0 ||
+        (glm::dot(src.normal[j], normal) > 0.99f &&
+         fabsf(glm::dot(vec3(src.pos[j]) - vec3(pos), normal)) < PLANE_DISTANCE));
+    if(!samePlane)
+      continue;
+    float w = ((k & 1) ? fx : 1 - fx) * ((k >> 1) ? fy : 1 - fy);
+    sum += w * src.color[j];
+    weight += w;
+  }
+  return weight > 0 ? sum / weight : src.color[i];
+}
+
+//Is pixel i a gap between nearer neighbours on opposite sides?
+static bool inGap(const TweenFrame& frame, const vector<bool>& covered, int x, int y)
+{
+  int i = x + y * RAY_W;
+  float limit = frame.depth[i] * GAP_DEPTH;
+  auto nearer = [&](int nx, int ny)
+  {
+    if(nx < 0 || ny < 0 || nx >= RAY_W || ny >= RAY_H)
+      return false;
+    int j = nx + ny * RAY_W;
+    return covered[j] && frame.depth[j] < limit;
+  };
+  return (nearer(x - 1, y) && nearer(x + 1, y)) || (nearer(x, y - 1) && nearer(x, y + 1));
+}
+
+void tweenFrame(const TweenFrame& a, const TweenFrame& b, float t, TweenFrame& frame)
+{
+  int n = RAY_W * RAY_H;
+  mat4 viewProj = proj * view;
+  vector<int> hitA, hitB;
+  vector<float> depthA, depthB;
+  splat(a, viewProj, hitA, depthA);
+  splat(b, viewProj, hitB, depthB);
+  frame.color.resize(n);
+  frame.pos.resize(n);
+  frame.normal.resize(n);
+  frame.depth.resize(n);
+  frame.viewProj = viewProj;
+  setupCameraRays();
+  vector<bool> covered(n);
+  for(int i = 0; i < n; i++)
+  {
+    int ia = hitA[i];
+    int ib = hitB[i];
+    covered[i] = ia >= 0 || ib >= 0;
+    if(!covered[i])
+      continue;
+    //a surface only one frame sees is in front of what the other sees
+    //there, or the other frame doesn't see that part of the view at all
+    bool useA = ib < 0 || (ia >= 0 && depthA[i] < depthB[i] * (1 - SAME_DEPTH));
+    bool useB = ia < 0 || (ib >= 0 && depthB[i] < depthA[i] * (1 - SAME_DEPTH));
+    vec3 origin, direction;
+    cameraRay(i % RAY_W, i / RAY_W, origin, direction);
+    if(useA)
+      frame.color[i] = resample(a, ia, origin, direction);
+    else if(useB)
+      frame.color[i] = resample(b, ib, origin, direction);
+    else
+      frame.color[i] = resample(a, ia, origin, direction) * (1 - t) + resample(b, ib, origin, direction) * t;
+    bool fromA = useA || (!useB && t < 0.5f);
+    frame.pos[i] = fromA ? a.pos[ia] : b.pos[ib];
+    frame.normal[i] = fromA ? a.normal[ia] : b.normal[ib];
+    frame.depth[i] = fromA ? depthA[i] : depthB[i];
+  }
+  vector<int> holes;
+  for(int y = 0; y < RAY_H; y++)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      if(!covered[i] || inGap(frame, covered, x, y))
+        holes.push_back(i);
+      else
+        storePixel(x, y, frame.color[i]);
+    }
+  }
+  renderPixels(holes, HOLE_SAMPLES);
+  //the depth of traced pixels isn't known, so their motion is the
+  //camera's rotation, like sky
+  for(int i : holes)
+  {
+    vec3 origin, direction;
+    cameraRay(i % RAY_W, i / RAY_W, origin, direction);
+    frame.color[i] = hdrBuf[i];
+    frame.pos[i] = vec4(direction, 0);
+    frame.depth[i] = INFINITY;
+  }
+}
+
+void writeMotion(const TweenFrame& frame, const mat4& lastViewProj, string fname)
+{
+  size_t dot = fname.rfind('.');
+  fname = (dot == string::npos ? fname : fname.substr(0, dot)) + "_motion.pfm";
+  FILE* f = fopen(fname.c_str(), "wb");
+  if(!f)
+  {
+    perror(fname.c_str());
+    return;
+  }
+  //same layout as writePFM: little-endian, bottom row first
+  fprintf(f, "PF\n%d %d\n-1.0\n", RAY_W, RAY_H);
+  vector<float> row(3 * RAY_W);
+  for(int y = 0; y < RAY_H; y++)
+  {
+    for(int x = 0; x < RAY_W; x++)
+    {
+      int i = x + y * RAY_W;
+      vec4 clip = lastViewProj * frame.pos[i];
+      float dx = 0;
+      float dy = 0;
+      if(clip.w > 0)
+      {
+        dx = (clip.x / clip.w + 1) * 0.5f * RAY_W - x;
+        dy = (clip.y / clip.w + 1) * 0.5f * RAY_H - y;
+      }
+      row[3 * x] = dx;
+      row[3 * x + 1] = dy;
+      row[3 * x + 2] = frame.pos[i].w == 0 ? 0 : frame.depth[i];
+    }
+    fwrite(&row[0], sizeof(float), row.size(), f);
+  }
+  fclose(f);
+}
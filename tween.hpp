@@ -0,0 +1,42 @@
+#ifndef TWEEN_H
+#define TWEEN_H
+
+#include "ray.hpp"
+
+//Frame interpolation for --animate. The world doesn't change during a
+//video, so once a frame is rendered, the depth of each pixel's first hit
+//places it in the world, and projecting that point with another frame's
+//camera gives the pixel's motion vector to that frame.
+//With ANIMATE_STEP N, only every Nth frame (and the last) is path traced.
+//A frame in between is made by projecting the rendered frames on either
+//side of it into its view, the nearest surface winning where several land
+//on one pixel. That tells each pixel which surface it sees; its color is
+//then filtered from where its own ray meets that surface in the rendered
+//frame. Where both frames see the same surface their colors are blended
+//by how close in time each is; otherwise the one that sees it is used.
+//Pixels neither frame covers (disoccluded, or gaps where a surface is
+//magnified) get a few paths of their own.
+
+//A frame's colors and what its pixels see
+struct TweenFrame
+{
+  vector<vec3> color;
+  //first hit of each pixel (w = 1), or the direction of the sky (w = 0)
+  vector<vec4> pos;
+  vector<vec3> normal;
+  //depth from the camera (infinite for sky)
+  vector<float> depth;
+  mat4 viewProj;
+};
+
+//Keep the frame render() just finished (a fancy frame with its features)
+void captureFrame(TweenFrame& frame);
+//Make the current view, t of the way from a to b, in the float
+//framebuffer, and keep it in frame
+void tweenFrame(const TweenFrame& a, const TweenFrame& b, float t, TweenFrame& frame);
+//Write frame's motion vectors and depth as a PFM image (named after
+//fname): the offset in pixels from each pixel to where its surface was in
+//the previous frame (viewed with lastViewProj), and the depth (0 for sky)
+void writeMotion(const TweenFrame& frame, const mat4& lastViewProj, string fname);
+
+#endif
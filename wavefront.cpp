@@ -0,0 +1,739 @@
+#include "wavefront.hpp"
+#include "ray.hpp"
+#include "world.hpp"
+#include "tiles.hpp"
+#include "player.hpp"
+#include "denoise.hpp"
+#include "sampler.hpp"
+#include <cstdio>
+#include <cmath>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <time.h>
+
+using std::vector;
+
+//number of paths in flight at once
+#define POOL_SIZE (1 << 18)
+//paths handled by one thread task within a stage
+#define STAGE_GRAIN 2048
+//passes before the noise estimate is trusted
+#define MIN_NOISE_PASSES 4
+//samples a pixel takes before adaptive sampling may retire it
+#define ADAPTIVE_MIN_SAMPLES 16
+//z value for the confidence interval adaptive sampling tests (95%)
+#define ADAPTIVE_Z 1.96f
+//sampler dimension slots: one for the pixel jitter, then these for
+//every surface hit (in order: Fresnel choice, sun point, lobe choice,
+//bounce direction, Russian roulette)
+#define CAMERA_SLOTS 1
+#define HIT_SLOTS 5
+//idle refinement traces batches of this many pixels until a frame's
+//worth of time has passed, visiting pixels REFINE_STRIDE apart (mod the
+//pixel count) so the whole image improves evenly. A pixel is done once it
+//has FANCY_RAYS_PER_PIXEL samples, or (with RENDER_NOISE_TARGET) once its
+//standard error is under the target.
+#define REFINE_BATCH (1 << 14)
+#define REFINE_FRAME_TIME 0.05
+#define REFINE_STRIDE 104729
+
+//one float array per component
+struct Vec3Array
+{
+  float* x;
+  float* y;
+  float* z;
+  void alloc(int n)
+  {
+    x = new float[n];
+    y = new float[n];
+    z = new float[n];
+  }
+  vec3 get(int i) const
+  {
+    return vec3(x[i], y[i], z[i]);
+  }
+  void set(int i, vec3 v)
+  {
+    x[i] = v.x;
+    y[i] = v.y;
+    z[i] = v.z;
+  }
+};
+
+//one sample of one pixel
+struct WorkItem
+{
+  int pixel;
+  int sample;
+};
+
+//state of every path slot
+struct PathPool
+{
+  //current ray segment
+  Vec3Array origin;
+  Vec3Array dir;
+  //light gathered so far, and the fraction of further light that reaches the eye
+  Vec3Array color;
+  Vec3Array influence;
+  int* bounces;
+  //surfaces hit so far (including ones passed through)
+  int* hits;
+  Sampler* sampler;
+  //weight of the sun if the current segment escapes into it
+  float* sunWeight;
+  //how fast the segment's footprint grows (see collideRay)
+  float* spread;
+  //output of the extend stage
+  Vec3Array hit;
+  Vec3Array normal;
+  Block* prevMat;
+  Block* nextMat;
+  byte* escaped;
+  //sun light added to color if the shadow ray from hit reaches the sun
+  Vec3Array pending;
+  Vec3Array toSun;
+  byte* shadowAir;
+  byte* wantShadow;
+  //work item being traced (-1 if none), its result, and whether the
+  //result is exact
+  int* item;
+  int* pixel;
+  Vec3Array result;
+  byte* exact;
+  //current path has finished
+  byte* done;
+  //path hasn't reached its first surface yet (for the feature buffers)
+  byte* primary;
+};
+
+static PathPool pool;
+static bool poolAllocated = false;
+//where first hits are recorded during the first pass (NULL otherwise)
+static FeatureBuffers* recordFeatures = NULL;
+FeatureBuffers frameFeatures;
+
+static void allocPool()
+{
+  if(poolAllocated)
+    return;
+  pool.origin.alloc(POOL_SIZE);
+  pool.dir.alloc(POOL_SIZE);
+  pool.color.alloc(POOL_SIZE);
+  pool.influence.alloc(POOL_SIZE);
+  pool.bounces = new int[POOL_SIZE];
+  pool.hits = new int[POOL_SIZE];
+  pool.sampler = new Sampler[POOL_SIZE];
+  pool.sunWeight = new float[POOL_SIZE];
+  pool.spread = new float[POOL_SIZE];
+  pool.hit.alloc(POOL_SIZE);
+  pool.normal.alloc(POOL_SIZE);
+  pool.prevMat = new Block[POOL_SIZE];
+  pool.nextMat = new Block[POOL_SIZE];
+  pool.escaped = new byte[POOL_SIZE];
+  pool.pending.alloc(POOL_SIZE);
+  pool.toSun.alloc(POOL_SIZE);
+  pool.shadowAir = new byte[POOL_SIZE];
+  pool.wantShadow = new byte[POOL_SIZE];
+  pool.item = new int[POOL_SIZE];
+  pool.result.alloc(POOL_SIZE);
+  pool.exact = new byte[POOL_SIZE];
+  pool.done = new byte[POOL_SIZE];
+  pool.pixel = new int[POOL_SIZE];
+  pool.primary = new byte[POOL_SIZE];
+  poolAllocated = true;
+}
+
+//Sampler positioned at the slots of the path's next surface hit.
+//Random numbers only depend on the pixel, sample and hit, so results
+//don't depend on how paths are scheduled across threads.
+static inline Sampler& hitSampler(int i)
+{
+  Sampler& s = pool.sampler[i];
+  s.dim = CAMERA_SLOTS + pool.hits[i] * HIT_SLOTS;
+  return s;
+}
+
+//Call fn(queue[j]) for every j, in parallel
+template<typename F>
+static void runStage(const vector<int>& queue, F fn)
+{
+  int n = queue.size();
+  parallelFor((n + STAGE_GRAIN - 1) / STAGE_GRAIN, [&](int block)
+  {
+    int end = std::min(n, (block + 1) * STAGE_GRAIN);
+    for(int j = block * STAGE_GRAIN; j < end; j++)
+      fn(queue[j]);
+  });
+}
+
+//Stable counting sort of path indices by a key in [0, numKeys)
+template<typename K>
+static void binPaths(const vector<int>& in, vector<int>& out, int numKeys, K key)
+{
+  vector<int> start(numKeys + 1, 0);
+  for(size_t j = 0; j < in.size(); j++)
+    start[key(in[j]) + 1]++;
+  for(int k = 0; k < numKeys; k++)
+    start[k + 1] += start[k];
+  out.resize(in.size());
+  for(size_t j = 0; j < in.size(); j++)
+    out[start[key(in[j])]++] = in[j];
+}
+
+static void startPath(int i, const WorkItem& item)
+{
+  Sampler& s = pool.sampler[i];
+  s.start(item.pixel, item.sample);
+  //jitter within the pixel's footprint, for antialiasing
+  vec2 jitter = s.get2D();
+  vec3 origin, direction;
+  cameraRay(item.pixel % RAY_W + jitter.x, item.pixel / RAY_W + jitter.y, origin, direction);
+  pool.origin.set(i, origin);
+  pool.dir.set(i, direction);
+  pool.color.set(i, vec3(0, 0, 0));
+  pool.influence.set(i, vec3(1, 1, 1));
+  pool.bounces[i] = 0;
+  pool.hits[i] = 0;
+  pool.sunWeight[i] = 1;
+  pool.spread[i] = cameraSpread();
+  pool.result.set(i, vec3(0, 0, 0));
+  pool.exact[i] = 0;
+  pool.done[i] = 0;
+  pool.pixel[i] = item.pixel;
+  pool.primary[i] = 1;
+}
+
+static void extendPath(int i)
+{
+  ivec3 block;
+  vec3 normal;
+  Block prevMat, nextMat;
+  bool escape = false;
+  vec3 hit = collideRay(pool.origin.get(i), pool.dir.get(i), block, normal, prevMat, nextMat, escape, pool.spread[i]);
+  pool.hit.set(i, hit);
+  pool.normal.set(i, normal);
+  pool.prevMat[i] = prevMat;
+  pool.nextMat[i] = nextMat;
+  pool.escaped[i] = escape;
+}
+
+static void escapePath(int i)
+{
+  bool exact = false;
+  //the ocean uses the Fresnel slot of the hit it would have been
+  float u = hitSampler(i).get1D();
+  vec3 value = processEscapedRay(pool.hit.get(i), pool.dir.get(i),
+      pool.color.get(i), pool.influence.get(i), pool.bounces[i], pool.sunWeight[i], u, exact);
+  pool.result.set(i, value);
+  pool.exact[i] = exact;
+  pool.done[i] = 1;
+  vec3 pos = pool.hit.get(i);
+  vec3 dir = pool.dir.get(i);
+  if(recordFeatures && pool.primary[i] && !exact && dir.y < 0 && pos.y >= seaLevel)
+  {
+    //primary ray reached the ocean outside the world
+    int p = pool.pixel[i];
+    vec3 surface = pos - dir * ((pos.y - seaLevel) / dir.y);
+    recordFeatures->albedo[p] = vec3(1, 1, 1);
+    recordFeatures->normal[p] = vec3(0, 1, 0);
+    recordFeatures->depth[p] = glm::length(surface - player);
+    recordFeatures->material[p] = WATER;
+  }
+}
+
+//Same shading as tracePath in ray.cpp (with soft shadows), except that
+//the sun's direct contribution is left in pending for the shadow stage
+static void shadePath(int i)
+{
+  vec3 origin = pool.origin.get(i);
+  vec3 direction = pool.dir.get(i);
+  vec3 intersect = pool.hit.get(i);
+  vec3 normal = pool.normal.get(i);
+  Block prevMaterial = pool.prevMat[i];
+  Block nextMaterial = pool.nextMat[i];
+  vec3 colorInfluence = pool.influence.get(i);
+  Sampler& s = hitSampler(i);
+  pool.hits[i]++;
+  pool.wantShadow[i] = 0;
+  vec4 texel = sample(nextMaterial, faceSide(normal), intersect.x, intersect.y, intersect.z);
+  if((isTransparent(prevMaterial) && nextMaterial == WATER) ||
+      (isTransparent(nextMaterial) && prevMaterial == WATER))
+  {
+    //crossing the water surface: use the perturbed water normal
+    if(normal.y < 0)
+      normal = -waterNormal(intersect);
+    else if(normal.y > 0)
+      normal = waterNormal(intersect);
+  }
+  if(recordFeatures && pool.primary[i] && (texel.w > 0.5 || nextMaterial == WATER))
+  {
+    //first surface the primary ray can't see straight through
+    int p = pool.pixel[i];
+    recordFeatures->albedo[p] = nextMaterial == WATER ? vec3(1, 1, 1) : vec3(texel);
+    recordFeatures->normal[p] = normal;
+    recordFeatures->depth[p] = glm::length(intersect - player);
+    recordFeatures->material[p] = nextMaterial;
+    pool.primary[i] = 0;
+  }
+  if(texel.w < 0.5)
+  {
+    texel = vec4(1, 1, 1, 0);
+  }
+  bool refract = false;
+  float nPrev = materials[prevMaterial].ior;
+  float nNext = materials[nextMaterial].ior;
+  float r0 = fresnelR0[prevMaterial][nextMaterial];
+  float cosTheta = fabsf(glm::dot(normal, direction));
+  float fresnel = r0 + (1 - r0) * powf(1 - cosTheta, 5);
+  float fresnelChoice = s.get1D();
+  if(texel.w < 0.5)
+  {
+    //from one transparent medium to another
+    if(nPrev <= nNext)
+    {
+      if(fresnelChoice > fresnel)
+        refract = true;
+    }
+    else
+    {
+      float cosCriticalAngle = cosf(asinf(nNext / nPrev));
+      if(cosTheta > cosCriticalAngle)
+      {
+        refract = true;
+      }
+      else if(prevMaterial == WATER)
+      {
+        colorInfluence *= waterHue;
+      }
+    }
+  }
+  if(refract)
+  {
+    direction = normalize(glm::refract(direction, normal, nPrev / nNext));
+    if(prevMaterial == WATER)
+    {
+      colorInfluence *= powf(waterClarity, glm::length(origin - intersect));
+    }
+    else if(nextMaterial == WATER)
+    {
+      colorInfluence *= waterHue;
+    }
+  }
+  else
+  {
+    if(prevMaterial == WATER)
+    {
+      //passed through some water, so reduce ray's brightness
+      colorInfluence *= powf(waterClarity, glm::length(origin - intersect));
+    }
+    if(nextMaterial == WATER)
+    {
+      texel = vec4(waterBlue, 1);
+    }
+    float spec = materials[nextMaterial].ks;
+    float diff = materials[nextMaterial].kd;
+    float diffuseChance = nextMaterial == WATER ? 0 : diff / (spec + diff);
+    pool.color.set(i, pool.color.get(i) + colorInfluence * ambient * vec3(texel));
+    vec2 sunPoint = s.get2D();
+    vec3 toSun = sampleSunCone(sunPoint.x, sunPoint.y);
+    float cosSun = glm::dot(normal, toSun);
+    if(cosSun >= 0)
+    {
+      float diffContrib = diff * cosSun;
+      vec3 halfway = normalize(toSun - direction);
+      float specContrib = spec * specularScale * powf(fmax(0, glm::dot(halfway, normal)), specExpo);
+      vec3 sunContrib = colorInfluence * (diffContrib * vec3(texel) + specContrib * vec3(1, 1, 1));
+      if(diffContrib > 0 || specContrib > 0)
+      {
+        pool.pending.set(i, sunContrib);
+        pool.normal.set(i, normal);
+        pool.toSun.set(i, toSun);
+        pool.shadowAir[i] = nPrev == 1;
+        pool.wantShadow[i] = 1;
+      }
+    }
+    float reflectivity = fmin(1, 0.5 * (spec + 0.3 * diff) * fresnel);
+    vec3 bounceColor;
+    float lobeChoice = s.get1D();
+    vec2 bounce = s.get2D();
+    bool diffuse = lobeChoice < diffuseChance;
+    if(diffuse)
+    {
+      direction = sampleCosine(normal, bounce.x, bounce.y);
+      pool.spread[i] = bounceSpread();
+      //the direct term above was all of this hit's sun light
+      pool.sunWeight[i] = 0;
+      bounceColor = reflectivity * desaturate(vec3(texel), 1 - fresnel);
+    }
+    else
+    {
+      direction = normalize(glm::reflect(direction, normal));
+      pool.sunWeight[i] = 1;
+      bounceColor = reflectivity * desaturate(vec3(texel), 0);
+    }
+    colorInfluence *= bounceColor;
+    int bounces = ++pool.bounces[i];
+    bool stop = bounces >= MAX_BOUNCES;
+    if(!stop && bounces >= rouletteMinBounces)
+    {
+      //Russian roulette
+      float survive = fmin(1, fmax(colorInfluence.x, fmax(colorInfluence.y, colorInfluence.z)));
+      if(s.get1D() >= survive)
+        stop = true;
+      else
+        colorInfluence /= survive;
+    }
+    if(stop)
+    {
+      //keep the light gathered so far (the shadow stage updates the
+      //result if it adds this hit's sun light)
+      pool.result.set(i, pool.color.get(i) * brightnessAdjust);
+      pool.done[i] = 1;
+    }
+  }
+  pool.influence.set(i, colorInfluence);
+  pool.dir.set(i, direction);
+  pool.origin.set(i, intersect);
+}
+
+static void shadowPath(int i)
+{
+  float light = sunTransmittance(pool.hit.get(i), pool.normal.get(i), pool.shadowAir[i], pool.toSun.get(i));
+  if(light > 0)
+  {
+    pool.color.set(i, pool.color.get(i) + light * pool.pending.get(i));
+  }
+  if(pool.done[i])
+    pool.result.set(i, pool.color.get(i) * brightnessAdjust);
+}
+
+//Frame state while rendering progressively
+struct Accumulator
+{
+  //sum of all samples for each pixel
+  vector<vec3> sum;
+  //sum of the (display) luminance of the samples and of its square, for
+  //the noise estimate
+  vector<float> sumLum;
+  vector<float> sumSq;
+  //number of samples taken
+  vector<int> count;
+  //the pixel's first sample was exact, so it needs no more
+  vector<byte> exact;
+  //first hits of the first pass, for the denoiser
+  FeatureBuffers features;
+};
+
+static float displayLuminance(vec3 c)
+{
+  return 0.2126f * fmin(c.x, 1) + 0.7152f * fmin(c.y, 1) + 0.0722f * fmin(c.z, 1);
+}
+
+//Trace every work item, adding each result into acc
+static void tracePass(const vector<WorkItem>& items, Accumulator& acc, bool probe)
+{
+  //small batches (refinement, renderPixels) only need as many slots as
+  //items, and only slots that held a path last round are visited, so
+  //the pool isn't scanned for the few paths that are left
+  int slots = std::min<size_t>(POOL_SIZE, items.size());
+  vector<int> live(slots);
+  for(int i = 0; i < slots; i++)
+  {
+    pool.item[i] = -1;
+    pool.done[i] = 1;
+    live[i] = i;
+  }
+  size_t nextItem = 0;
+  vector<int> active, sorted, escapeQueue, shadeQueue, shadowQueue;
+  while(true)
+  {
+    //retire finished paths and start new ones in their slots
+    active.clear();
+    for(int i : live)
+    {
+      if(pool.item[i] >= 0 && pool.done[i])
+      {
+        int pixel = items[pool.item[i]].pixel;
+        vec3 value = pool.result.get(i);
+        acc.sum[pixel] += value;
+        float lum = displayLuminance(value);
+        acc.sumLum[pixel] += lum;
+        acc.sumSq[pixel] += lum * lum;
+        acc.count[pixel]++;
+        if(probe && pool.exact[i])
+          acc.exact[pixel] = 1;
+        pool.item[i] = -1;
+      }
+      if(pool.item[i] < 0 && nextItem < items.size())
+      {
+        pool.item[i] = nextItem;
+        startPath(i, items[nextItem]);
+        nextItem++;
+      }
+      if(pool.item[i] >= 0)
+        active.push_back(i);
+    }
+    if(active.empty())
+      break;
+    live.swap(active);
+    //extend, with paths binned by direction octant for more coherent traversal
+    binPaths(live, sorted, 8, [](int i)
+    {
+      return (pool.dir.x[i] < 0) | (pool.dir.y[i] < 0) << 1 | (pool.dir.z[i] < 0) << 2;
+    });
+    runStage(sorted, extendPath);
+    escapeQueue.clear();
+    shadeQueue.clear();
+    for(size_t j = 0; j < sorted.size(); j++)
+    {
+      int i = sorted[j];
+      if(pool.escaped[i])
+        escapeQueue.push_back(i);
+      else
+        shadeQueue.push_back(i);
+    }
+    runStage(escapeQueue, escapePath);
+    //shade, with paths binned by the material they hit
+    binPaths(shadeQueue, sorted, NUM_TILES, [](int i)
+    {
+      return (int) pool.nextMat[i];
+    });
+    runStage(sorted, shadePath);
+    shadowQueue.clear();
+    for(size_t j = 0; j < sorted.size(); j++)
+    {
+      int i = sorted[j];
+      if(pool.wantShadow[i])
+        shadowQueue.push_back(i);
+    }
+    runStage(shadowQueue, shadowPath);
+  }
+}
+
+//Standard error of a pixel's mean, in display luminance
+static float pixelError(const Accumulator& acc, int p)
+{
+  int n = acc.count[p];
+  if(n < 2)
+    return INFINITY;
+  //mean of the same clamped luminance the squares are of (not the
+  //luminance of the mean color, which fireflies push above 1)
+  float mean = acc.sumLum[p] / n;
+  float variance = fmax(0, acc.sumSq[p] / n - mean * mean) * n / (n - 1);
+  return sqrtf(variance / n);
+}
+
+//RMS standard error of the pixel means
+static float estimateNoise(const Accumulator& acc)
+{
+  double total = 0;
+  int counted = 0;
+  for(size_t p = 0; p < acc.sum.size(); p++)
+  {
+    if(acc.exact[p])
+      continue;
+    float err = pixelError(acc, p);
+    total += err * err;
+    counted++;
+  }
+  return counted ? sqrt(total / counted) : 0;
+}
+
+//Write the mean of the samples so far to frameBuf
+static void resolve(const Accumulator& acc)
+{
+  int n = acc.sum.size();
+  vector<vec3> color(n);
+  vector<float> variance(n);
+  for(int p = 0; p < n; p++)
+  {
+    color[p] = acc.sum[p] / float(acc.count[p]);
+    float err = acc.exact[p] ? 0 : fmin(pixelError(acc, p), 1);
+    variance[p] = err * err;
+  }
+  if(DENOISE)
+    denoise(color, variance, acc.features);
+  for(int p = 0; p < n; p++)
+  {
+    storePixel(p % RAY_W, p / RAY_W, color[p]);
+  }
+}
+
+static double seconds()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void renderWavefront(bool write, string fname)
+{
+  allocPool();
+  double start = seconds();
+  double lastOutput = start;
+  int numPixels = RAY_W * RAY_H;
+  Accumulator acc;
+  acc.sum.assign(numPixels, vec3(0, 0, 0));
+  acc.sumLum.assign(numPixels, 0);
+  acc.sumSq.assign(numPixels, 0);
+  acc.count.assign(numPixels, 0);
+  acc.exact.assign(numPixels, 0);
+  acc.features.resize(numPixels);
+  //first pass: a pixel whose first sample is exact (sky seen directly)
+  //needs no more samples
+  vector<WorkItem> items;
+  for(int p = 0; p < numPixels; p++)
+  {
+    WorkItem item = {p, 0};
+    items.push_back(item);
+  }
+  recordFeatures = &acc.features;
+  tracePass(items, acc, true);
+  recordFeatures = NULL;
+  //samples are jittered, so an exact pixel next to an inexact one may
+  //still be partly covered by geometry: keep sampling it for antialiasing
+  vector<byte> interior(acc.exact);
+  for(int p = 0; p < numPixels; p++)
+  {
+    int x = p % RAY_W;
+    int y = p / RAY_W;
+    for(int ny = std::max(y - 1, 0); ny <= std::min(y + 1, RAY_H - 1) && interior[p]; ny++)
+    {
+      for(int nx = std::max(x - 1, 0); nx <= std::min(x + 1, RAY_W - 1); nx++)
+      {
+        if(!acc.exact[nx + ny * RAY_W])
+        {
+          interior[p] = 0;
+          break;
+        }
+      }
+    }
+  }
+  acc.exact.swap(interior);
+  vector<int> pending;
+  for(int p = 0; p < numPixels; p++)
+  {
+    if(!acc.exact[p])
+      pending.push_back(p);
+  }
+  //then one more sample per pass for every pixel that is still pending
+  int pass = 1;
+  while(pass < RAYS_PER_PIXEL && !pending.empty())
+  {
+    float elapsed = seconds() - start;
+    if(RENDER_TIME_BUDGET > 0 && elapsed >= RENDER_TIME_BUDGET)
+    {
+      printf("Time budget reached after %d passes\n", pass);
+      break;
+    }
+    if(RENDER_NOISE_TARGET > 0 && pass >= MIN_NOISE_PASSES)
+    {
+      float noise = estimateNoise(acc);
+      if(noise <= RENDER_NOISE_TARGET)
+      {
+        printf("Noise target reached after %d passes (noise %.4f)\n", pass, noise);
+        break;
+      }
+    }
+    if(ADAPTIVE_THRESHOLD > 0 && pass >= ADAPTIVE_MIN_SAMPLES)
+    {
+      //retire pixels whose confidence interval is already within the threshold
+      size_t kept = 0;
+      for(size_t j = 0; j < pending.size(); j++)
+      {
+        if(ADAPTIVE_Z * pixelError(acc, pending[j]) > ADAPTIVE_THRESHOLD)
+          pending[kept++] = pending[j];
+      }
+      pending.resize(kept);
+      if(pending.empty())
+        break;
+    }
+    items.resize(pending.size());
+    for(size_t j = 0; j < pending.size(); j++)
+    {
+      WorkItem item = {pending[j], pass};
+      items[j] = item;
+    }
+    tracePass(items, acc, false);
+    pass++;
+    printf("Image is %.1f%% done (%d pixels still sampling)\n", 100.0 * pass / RAYS_PER_PIXEL, (int) pending.size());
+    if(write && PROGRESS_INTERVAL > 0 && seconds() - lastOutput >= PROGRESS_INTERVAL)
+    {
+      lastOutput = seconds();
+      resolve(acc);
+      writeFrame(fname);
+    }
+  }
+  resolve(acc);
+  if(write && WRITE_FEATURES)
+    writeFeatures(acc.features, fname);
+  std::swap(frameFeatures, acc.features);
+}
+
+//samples of the view being refined, and the position of the next batch
+//in the pixel order
+static Accumulator refineAcc;
+static long long refineNext;
+static int refineStride;
+
+static int gcd(int a, int b)
+{
+  return b ? gcd(b, a % b) : a;
+}
+
+//Whether idle refinement is done with pixel p
+static bool refinedPixel(int p)
+{
+  int n = refineAcc.count[p];
+  if(n >= FANCY_RAYS_PER_PIXEL)
+    return true;
+  return RENDER_NOISE_TARGET > 0 && n >= MIN_NOISE_PASSES && pixelError(refineAcc, p) <= RENDER_NOISE_TARGET;
+}
+
+bool refineWavefront(bool restart)
+{
+  allocPool();
+  int numPixels = RAY_W * RAY_H;
+  if(restart || (int) refineAcc.sum.size() != numPixels)
+  {
+    refineAcc.sum.assign(numPixels, vec3(0, 0, 0));
+    refineAcc.sumLum.assign(numPixels, 0);
+    refineAcc.sumSq.assign(numPixels, 0);
+    refineAcc.count.assign(numPixels, 0);
+    refineAcc.exact.assign(numPixels, 0);
+    refineNext = 0;
+    //the stride has to be coprime to the pixel count to visit every pixel
+    refineStride = REFINE_STRIDE % numPixels;
+    while(gcd(refineStride, numPixels) != 1)
+      refineStride++;
+  }
+  double start = seconds();
+  vector<WorkItem> items;
+  do
+  {
+    items.clear();
+    //one lap of the stride at most, so no pixel is in a batch twice
+    for(int j = 0; j < numPixels && (int) items.size() < REFINE_BATCH; j++)
+    {
+      int p = (refineNext++ * refineStride) % numPixels;
+      if(refinedPixel(p))
+        continue;
+      WorkItem item = {p, refineAcc.count[p]};
+      items.push_back(item);
+    }
+    if(items.empty())
+      break;
+    tracePass(items, refineAcc, false);
+  }
+  while(seconds() - start < REFINE_FRAME_TIME);
+  //pixels without samples yet keep what the last fast frame stored
+  for(int p = 0; p < numPixels; p++)
+  {
+    if(refineAcc.count[p])
+      storePixel(p % RAY_W, p / RAY_W, refineAcc.sum[p] / float(refineAcc.count[p]));
+  }
+  return items.empty();
+}
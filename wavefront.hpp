@@ -0,0 +1,31 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <string>
+#include "denoise.hpp"
+
+using std::string;
+
+//Wavefront path tracer used for fancy renders (MAX_BOUNCES > 1).
+//Instead of following one path to completion at a time, a large pool of
+//paths is advanced one segment per iteration through separate stages:
+//  extend: traverse the world to the next hit (paths binned by direction)
+//  escape: sky, sun and the analytic ocean for paths that left the world
+//  shade:  hit shading and path continuation (paths binned by material)
+//  shadow: sun visibility for hits that want a sun contribution
+//Each stage is a flat loop over a queue of path indices into
+//structure-of-arrays path state, spread over RAY_THREADS threads.
+
+//Render the frame progressively into frameBuf, with up to RAYS_PER_PIXEL
+//paths per pixel (render() has already set up the camera for the frame).
+//If write, intermediate images go to fname every PROGRESS_INTERVAL seconds.
+void renderWavefront(bool write, string fname);
+//First hits of the last frame renderWavefront finished
+extern FeatureBuffers frameFeatures;
+//Add samples to a running average of the current view for about one
+//interactive frame's time, starting a new average if restart, and store
+//the average of every pixel sampled so far. Returns true once every pixel
+//is done (see REFINE_BATCH in wavefront.cpp) and nothing was traced.
+bool refineWavefront(bool restart);
+
+#endif
@@ -1,17 +1,77 @@
 #include "world.hpp"
+#include "shadows.hpp"
+#include "reservoirs.hpp"
+#include "lod.hpp"
 #include <cstdio>
 #include <cstdlib>
 #include <cassert>
+#include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <vector>
+#include <pthread.h>
+#include "stdatomic.h"
 
 static Block* linearWorld = nullptr;
 
 using std::cout;
+using std::vector;
 
 //Have INV_W x INV_H inventory grid
 //Eventually, have at least a 4x4x4 chunks (64^3 blocks) world
 Chunk chunks[chunksX][chunksY][chunksZ];
 
+//Set once a chunk's final contents have been copied into linearWorld.
+//Until then, the ray tracer sees a placeholder: water below sea level, air above
+static atomic_int chunkReadyFlags[chunksX][chunksY][chunksZ];
+
+//Chunk-space box [occupiedLo, occupiedHi) around every chunk that has held
+//a non-air block since the world was (re)initialized. It only grows, so
+//everything outside it is always air.
+static atomic_int occupiedLo[3];
+static atomic_int occupiedHi[3];
+
+static atomic_int version;
+static atomic_int chunkVersions[chunksX][chunksY][chunksZ];
+
+static void growOccupied(int cx, int cy, int cz)
+{
+  int c[3] = {cx, cy, cz};
+  for(int i = 0; i < 3; i++)
+  {
+    int cur = atomic_load(&occupiedLo[i]);
+    while(c[i] < cur && !atomic_compare_exchange_strong(&occupiedLo[i], &cur, c[i]));
+    cur = atomic_load(&occupiedHi[i]);
+    while(c[i] + 1 > cur && !atomic_compare_exchange_strong(&occupiedHi[i], &cur, c[i] + 1));
+  }
+}
+
+void occupiedBounds(ivec3& lo, ivec3& hi)
+{
+  for(int i = 0; i < 3; i++)
+  {
+    lo[i] = 16 * atomic_load(&occupiedLo[i]);
+    hi[i] = 16 * atomic_load(&occupiedHi[i]);
+  }
+}
+
+int worldVersion()
+{
+  return atomic_load(&version);
+}
+
+int chunkVersion(int cx, int cy, int cz)
+{
+  return atomic_load(&chunkVersions[cx][cy][cz]);
+}
+
+static inline int linearIndex(int x, int y, int z)
+{
+  const int wy = chunksY * 16;
+  const int wz = chunksZ * 16;
+  return x * wy * wz + y * wz + z;
+}
+
 void setBlock(Block b, int x, int y, int z)
 {
   if(!blockInBounds(x, y, z))
@@ -19,28 +79,33 @@ void setBlock(Block b, int x, int y, int z)
     return;
   }
   Chunk* chunk = &chunks[x / 16][y / 16][z / 16];
+  Block old = chunk->blocks[x % 16][y % 16][z % 16];
   chunk->blocks[x % 16][y % 16][z % 16] = b;
-  if(linearWorld)
+  if(chunkReady(x, y, z))
   {
-    //world was already generated, need to keep numFilled and linearWorld
+    //chunk was already published, need to keep numFilled and linearWorld
     //up to date
-    if(b == getBlockFast(x, y, z))
+    if(b == old)
       return;
-    const int wy = chunksY * 16;
-    const int wz = chunksZ * 16;
-    linearWorld[x * wy * wz + y * wz + z] = b;
+    linearWorld[linearIndex(x, y, z)] = b;
+    updateLod(ivec3(x, y, z), ivec3(x + 1, y + 1, z + 1));
+    invalidateShadowsThrough(x, y, z);
+    invalidateReservoirs();
+    atomic_fetch_add(&chunkVersions[x / 16][y / 16][z / 16], 1);
+    atomic_fetch_add(&version, 1);
     if(b == AIR)
       chunk->numFilled--;
-    else
+    else if(old == AIR)
+    {
       chunk->numFilled++;
+      growOccupied(x / 16, y / 16, z / 16);
+    }
   }
 }
 
 Block getBlockFast(int x, int y, int z)
 {
-  const int wy = chunksY * 16;
-  const int wz = chunksZ * 16;
-  return linearWorld[x * wy * wz + y * wz + z];
+  return linearWorld[linearIndex(x, y, z)];
 }
 
 Block getBlock(int x, int y, int z)
@@ -61,14 +126,40 @@ bool blockInBounds(int x, int y, int z)
     x < 16 * chunksX && y < 16 * chunksY && z < 16 * chunksZ;
 }
 
-//Seed rng with unique hash of block coordinates, combined with octave value
-void srandBlockHash(int x, int y, int z, int octave)
+bool chunkReady(int x, int y, int z)
+{
+  if(!blockInBounds(x, y, z))
+    return false;
+  return atomic_load(&chunkReadyFlags[x / 16][y / 16][z / 16]);
+}
+
+static unsigned hashMix(unsigned h)
+{
+  h ^= h >> 16;
+  h *= 0x7feb352d;
+  h ^= h >> 15;
+  h *= 0x846ca68b;
+  h ^= h >> 16;
+  return h;
+}
+
+//Unique hash of block coordinates, combined with octave value
+//(stateless, so that columns can be generated in any order and on any thread)
+static unsigned blockHash(int x, int y, int z, int octave)
 {
-  srand(SEED ^ (4 * (x + y * (chunksX * 16 + 1) + z * (chunksX * 16 * chunksY * 16 + 1)) + octave));
+  return hashMix(SEED ^ (4 * (x + y * (chunksX * 16 + 1) + z * (chunksX * 16 * chunksY * 16 + 1)) + octave));
 }
 
-//replace all "replace" blocks with "with", in ellipsoidal region
-void replaceEllipsoid(Block replace, Block with, int x, int y, int z, float rx, float ry, float rz)
+//Step a hash-seeded random stream
+static unsigned nextRand(unsigned& state)
+{
+  state = hashMix(state + 0x9e3779b9);
+  return state;
+}
+
+//replace all "replace" blocks with "with", in ellipsoidal region,
+//only modifying blocks within chunk column (cx, cz)
+void replaceEllipsoid(Block replace, Block with, int x, int y, int z, float rx, float ry, float rz, int cx, int cz)
 {
   for(int lx = x - rx; lx <= x + rx + 1; lx++)
   {
@@ -78,6 +169,8 @@ void replaceEllipsoid(Block replace, Block with, int x, int y, int z, float rx,
       {
         if(!blockInBounds(lx, ly, lz))
           continue;
+        if(lx / 16 != cx || lz / 16 != cz)
+          continue;
         if(getBlock(lx, ly, lz) != replace)
           continue;
         //compute weighted distance squared from ellipsoid center to block center
@@ -108,11 +201,77 @@ static void setNumFilled()
   }
 }
 
+//Allocate linearWorld and fill it with the placeholder for chunks that
+//haven't been generated yet: water below sea level and air above
+static void initLinearWorld()
+{
+  int wx = chunksX * 16;
+  int wy = chunksY * 16;
+  int wz = chunksZ * 16;
+  if(!linearWorld)
+    linearWorld = new Block[wx * wy * wz];
+  for(int i = 0; i < wx; i++)
+    for(int j = 0; j < wy; j++)
+      for(int k = 0; k < wz; k++)
+      {
+        linearWorld[linearIndex(i, j, k)] = j < seaLevel ? WATER : AIR;
+      }
+  buildLod();
+  const int dims[3] = {chunksX, chunksY, chunksZ};
+  for(int i = 0; i < 3; i++)
+  {
+    atomic_store(&occupiedLo[i], dims[i]);
+    atomic_store(&occupiedHi[i], 0);
+  }
+  for(int i = 0; i < chunksX; i++)
+    for(int j = 0; j < chunksY; j++)
+      for(int k = 0; k < chunksZ; k++)
+      {
+        chunks[i][j][k].numFilled = j * 16 < seaLevel ? 4096 : 0;
+        if(chunks[i][j][k].numFilled)
+          growOccupied(i, j, k);
+        atomic_store(&chunkReadyFlags[i][j][k], 0);
+      }
+}
+
+//Copy a finished column of chunks into linearWorld and mark it ready
+static void publishColumn(int cx, int cz)
+{
+  for(int cy = 0; cy < chunksY; cy++)
+  {
+    Chunk* c = &chunks[cx][cy][cz];
+    int filled = 0;
+    for(int i = 0; i < 16; i++)
+    {
+      for(int j = 0; j < 16; j++)
+      {
+        for(int k = 0; k < 16; k++)
+        {
+          Block b = c->blocks[i][j][k];
+          linearWorld[linearIndex(cx * 16 + i, cy * 16 + j, cz * 16 + k)] = b;
+          if(b != AIR)
+            filled++;
+        }
+      }
+    }
+    updateLod(ivec3(cx * 16, cy * 16, cz * 16), ivec3(cx * 16 + 16, cy * 16 + 16, cz * 16 + 16));
+    c->numFilled = filled;
+    if(filled)
+      growOccupied(cx, cy, cz);
+    atomic_store(&chunkReadyFlags[cx][cy][cz], 1);
+    atomic_fetch_add(&chunkVersions[cx][cy][cz], 1);
+  }
+  invalidateShadows();
+  invalidateReservoirs();
+  atomic_fetch_add(&version, 1);
+}
+
 void flatGen()
 {
   int wx = chunksX * 16;
   int wy = chunksY * 16;
   int wz = chunksZ * 16;
+  initLinearWorld();
   for(int i = 0; i < wx; i++)
   {
     for(int j = 0; j < wy; j++)
@@ -131,365 +290,481 @@ void flatGen()
     }
   }
   setNumFilled();
+  for(int i = 0; i < chunksX; i++)
+    for(int k = 0; k < chunksZ; k++)
+      publishColumn(i, k);
 }
 
-void initLinearWorld()
+/*  Terrain is generated one column of chunks (all chunks sharing cx, cz)
+    at a time, on background threads, starting with the columns nearest to
+    a focus point. Every step only depends on block coordinates (never on
+    generation order), so a column can be computed alone from a padded
+    region around it and will line up with its neighbors. Columns are
+    published to the ray tracer as soon as they are done.
+*/
+
+//Generating a column reads smoothed noise in a margin around it: sand
+//placement looks SAND_RADIUS blocks away, and every smoothing sweep reads
+//one more block in the +x, +y and +z directions
+#define SMOOTH_SWEEPS 8
+#define SAND_RADIUS 2
+#define PAD_W (16 + 2 * SAND_RADIUS + SMOOTH_SWEEPS)
+#define PAD_H (chunksY * 16 + 2 * SAND_RADIUS)
+#define TERRAIN_THREADS 4
+
+//Per-thread working memory for one padded column. Cell (0, 0, 0) is block
+//(16 * cx - SAND_RADIUS, -SAND_RADIUS, 16 * cz - SAND_RADIUS).
+//Cells outside the world hold what getBlock returns there.
+struct ColumnScratch
+{
+  Block cells[PAD_W][PAD_H][PAD_W];
+  //water within SAND_RADIUS along z, then along z and y
+  bool waterZ[PAD_W][PAD_H][PAD_W];
+  bool waterZY[PAD_W][PAD_H][PAD_W];
+};
+
+//Fractal noise value in [0, 16) of an in-world block, before smoothing
+static int noiseValue(int x, int y, int z)
 {
   int wx = chunksX * 16;
   int wy = chunksY * 16;
   int wz = chunksZ * 16;
-  linearWorld = new Block[wx * wy * wz];
-  for(int i = 0; i < chunksX * 16; i++)
-    for(int j = 0; j < chunksY * 16; j++)
-      for(int k = 0; k < chunksZ * 16; k++)
-      {
-        linearWorld[i * wy * wz + j * wz + k] = getBlock(i, j, k);
-      }
+  float dist = sqrtf(powf(x - wx / 2, 2) + powf(y - wy / 2, 2));
+  float radius = std::min(wx / 2, wz / 2);
+  int val;
+  if(dist < radius * 0.2)
+    val = 4;
+  else if(dist < radius * 0.5)
+    val = 2;
+  else if(dist < radius * 0.7)
+    val = 1;
+  else
+    val = 0;
+  //sample at octaves 2 and 3
+  //octave i has amplitude 2^i and sample points every 2^(i+1) blocks
+  for(int octave = 2; octave < 4; octave++)
+  {
+    int amplitude = 1 << octave;
+    //period = distance between samples (must evenly divide 16)
+    int period = 2 * (1 << octave);
+    //lerp between the 8 corners of the sample cube containing (x, y, z)
+    int bx = x - x % period;
+    int by = y - y % period;
+    int bz = z - z % period;
+    int samples[8];
+    samples[0] = blockHash(bx + period, by + period, bz + period, octave) % (amplitude + 1);
+    samples[1] = blockHash(bx, by + period, bz + period, octave) % (amplitude + 1);
+    samples[2] = blockHash(bx + period, by, bz + period, octave) % (amplitude + 1);
+    samples[3] = blockHash(bx, by, bz + period, octave) % (amplitude + 1);
+    samples[4] = blockHash(bx + period, by + period, bz, octave) % (amplitude + 1);
+    samples[5] = blockHash(bx, by + period, bz, octave) % (amplitude + 1);
+    samples[6] = blockHash(bx + period, by, bz, octave) % (amplitude + 1);
+    samples[7] = blockHash(bx, by, bz, octave) % (amplitude + 1);
+    int lx = x - bx;
+    int ly = y - by;
+    int lz = z - bz;
+    //values proportional volume in cuboid between opposite corner and interpolation point
+    int v = 0;
+    v += samples[0] * lx * ly * lz;
+    v += samples[1] * (period - lx) * ly * lz;
+    v += samples[2] * lx * (period - ly) * lz;
+    v += samples[3] * (period - lx) * (period - ly) * lz;
+    v += samples[4] * lx * ly * (period - lz);
+    v += samples[5] * (period - lx) * ly * (period - lz);
+    v += samples[6] * lx * (period - ly) * (period - lz);
+    v += samples[7] * (period - lx) * (period - ly) * (period - lz);
+    //add the weighted average of sample cube corner values
+    val += 0.5 + v / (period * period * period);
+    if(val > 15)
+      val = 15;
+  }
+  //add a small adjustment value that decreases with altitude
+  //underground should be mostly solid, above sea level should be mostly empty
+  float shift = wy / 2 - y;
+  if(y > wy / 2)
+    shift = 1 + shift * 0.1;
+  else
+    shift = shift * 0.7;
+  val += shift;
+  if(val < 0)
+    val = 0;
+  if(val > 15)
+    val = 15;
+  return val;
 }
 
-void terrainGen()
+//Fill in the stone, water, dirt and sand of column (cx, cz)
+static void genColumnTerrain(ColumnScratch& s, int cx, int cz)
 {
   int wx = chunksX * 16;
   int wy = chunksY * 16;
   int wz = chunksZ * 16;
-  /*  build some fractal noise in-place (with already allocated 4 bits per block)
-      always clamp values to [0, 16)
-      first, fill with some random vals (with a small maximum, like 2)
-      then, repeatedly sample some small 3D region (-50%), scale its values up (+50%), and add it back to original
-      */
-  //Base fractal noise
-  //Each chunk computed independently (TODO: whole terrain gen should independent of neighbors in final product)
-  //sample at 4 octaves: 0, 1, 2, 3
-  //octave i has amplitude 2^i and frequency 2^(-i)
-  //that way, absolute max value possible is 15 (perfect for 4-bit range)
-  //assume octave 0 has sample points every 2 blocks
-  for(int c = 0; c < chunksX * chunksY * chunksZ; c++)
-  {
-    int cx = c % chunksX;
-    int cy = (c / chunksX) % chunksY;
-    int cz = c / (chunksX * chunksY);
-    for(int i = 0; i < 16; i++)
+  const int x0 = cx * 16 - SAND_RADIUS;
+  const int y0 = -SAND_RADIUS;
+  const int z0 = cz * 16 - SAND_RADIUS;
+  for(int i = 0; i < PAD_W; i++)
+  {
+    for(int j = 0; j < PAD_H; j++)
     {
-      for(int j = 0; j < 16; j++)
+      for(int k = 0; k < PAD_W; k++)
       {
-        for(int k = 0; k < 16; k++)
-        {
-          int x = cx * 16 + i;
-          int y = cy * 16 + j;
-          int z = cz * 16 + k;
-          float dist = sqrtf(powf(x - wx / 2, 2) + powf(y - wy / 2, 2));
-          float radius = std::min(wx / 2, wz / 2);
-          if(dist < radius * 0.2)
-            setBlock(4, x, y, z);
-          else if(dist < radius * 0.5)
-            setBlock(2, x, y, z);
-          else if(dist < radius * 0.7)
-            setBlock(1, x, y, z);
-          else
-            setBlock(0, x, y, z);
-        }
+        int x = x0 + i;
+        int y = y0 + j;
+        int z = z0 + k;
+        if(blockInBounds(x, y, z))
+          s.cells[i][j][k] = noiseValue(x, y, z);
+        else
+          s.cells[i][j][k] = getBlock(x, y, z);
       }
     }
-    for(int octave = 2; octave < 4; octave++)
+  }
+  //run a few sweeps of a smoothing function
+  //basically gaussian blur, but in-place
+  //each block becomes the rounded average of the 2x2x2 cube at its +x/+y/+z
+  //corner, so updating in increasing x, y, z order only reads values from the
+  //previous sweep, and each sweep shrinks the valid part of the margin by one
+  for(int sweep = 0; sweep < SMOOTH_SWEEPS; sweep++)
+  {
+    for(int i = 0; i < PAD_W - 1 - sweep; i++)
     {
-      int amplitude = 1 << octave;
-      //period = distance between samples (must evenly divide 16)
-      int period = 2 * (1 << octave);
-      //freq = samples per chunk length
-      int freq = 16 / period;
-      //loop over sample cubes, then loop over blocks within sample cubes and lerp its value from this octave
-      for(int sample = 0; sample < freq * freq * freq; sample++)
+      for(int j = -y0; j < -y0 + wy; j++)
       {
-        int sx = sample % freq;
-        int sy = (sample / freq) % freq;
-        int sz = sample / (freq * freq);
-        int bx = 16 * cx + sx * period;
-        int by = 16 * cy + sy * period;
-        int bz = 16 * cz + sz * period;
-        //samples at the 8 sampling cube corners
-        int samples[8];
-        srandBlockHash(bx + period, by + period, bz + period, octave);
-        samples[0] = rand() % (amplitude + 1);
-        srandBlockHash(bx, by + period, bz + period, octave);
-        samples[1] = rand() % (amplitude + 1);
-        srandBlockHash(bx + period, by, bz + period, octave);
-        samples[2] = rand() % (amplitude + 1);
-        srandBlockHash(bx, by, bz + period, octave);
-        samples[3] = rand() % (amplitude + 1);
-        srandBlockHash(bx + period, by + period, bz, octave);
-        samples[4] = rand() % (amplitude + 1);
-        srandBlockHash(bx, by + period, bz, octave);
-        samples[5] = rand() % (amplitude + 1);
-        srandBlockHash(bx + period, by, bz, octave);
-        samples[6] = rand() % (amplitude + 1);
-        srandBlockHash(bx, by, bz, octave);
-        samples[7] = rand() % (amplitude + 1);
-        for(int x = 0; x < period; x++)
+        for(int k = 0; k < PAD_W - 1 - sweep; k++)
         {
-          for(int y = 0; y < period; y++)
-          {
-            for(int z = 0; z < period; z++)
-            {
-              //values proportional volume in cuboid between opposite corner and interpolation point
-              int v = 0;
-              v += samples[0] * x * y * z;
-              v += samples[1] * (period - x) * y * z;
-              v += samples[2] * x * (period - y) * z;
-              v += samples[3] * (period - x) * (period - y) * z;
-              v += samples[4] * x * y * (period - z);
-              v += samples[5] * (period - x) * y * (period - z);
-              v += samples[6] * x * (period - y) * (period - z);
-              v += samples[7] * (period - x) * (period - y) * (period - z);
-              int val = getBlock(bx + x, by + y, bz + z);
-              //add the weighted average of sample cube corner values
-              val += 0.5 + v / (period * period * period);
-              if(val > 15)
-                val = 15;
-              setBlock(val, bx + x, by + y, bz + z);
-            }
-          }
+          int x = x0 + i;
+          int z = z0 + k;
+          if(x < 0 || z < 0 || x >= wx || z >= wz)
+            continue;
+          int neighborVals =
+            s.cells[i][j][k] + s.cells[i][j][k + 1] +
+            s.cells[i][j + 1][k] + s.cells[i][j + 1][k + 1] +
+            s.cells[i + 1][j][k] + s.cells[i + 1][j][k + 1] +
+            s.cells[i + 1][j + 1][k] + s.cells[i + 1][j + 1][k + 1];
+          //get sample value as rounded-to-nearest average of samples
+          neighborVals = (neighborVals + 4) / 8;
+          if(neighborVals >= 8 + (int) (blockHash(x, y0 + j, z, sweep) % 2))
+            s.cells[i][j][k] = 13;
+          else
+            s.cells[i][j][k] = 4;
         }
       }
     }
   }
-  //add a small adjustment value that decreases with altitude
-  //underground should be mostly solid, above sea level should be mostly empty
-  for(int x = 0; x < wx; x++)
+  //now the column and a SAND_RADIUS margin are valid
+  const int valid = 16 + 2 * SAND_RADIUS;
+  //set each block above a threshold to stone, and each below to air,
+  //with bedrock on the bottom layer and water filling air below sea level
+  for(int i = 0; i < valid; i++)
   {
-    for(int y = 0; y < wy; y++)
+    for(int j = -y0; j < -y0 + wy; j++)
     {
-      for(int z = 0; z < wz; z++)
+      for(int k = 0; k < valid; k++)
       {
-        float shift = wy / 2 - y;
-        if(y > wy / 2)
-          shift = 1 + shift * 0.1;
-        else
-          shift = shift * 0.7;
-        int val = getBlock(x, y, z);
-        val += shift;
-        if(val < 0)
-          val = 0;
-        if(val > 15)
-          val = 15;
-        setBlock(val, x, y, z);
+        int x = x0 + i;
+        int y = y0 + j;
+        int z = z0 + k;
+        if(!blockInBounds(x, y, z))
+          continue;
+        Block& b = s.cells[i][j][k];
+        b = b >= 6 ? STONE : AIR;
+        if(y == 0)
+          b = BEDROCK;
+        else if(b == AIR && y < wy / 2)
+          b = WATER;
       }
     }
   }
-  //run a few sweeps of a smoothing function
-  //basically gaussian blur, but in-place
-  for(int sweep = 0; sweep < 8; sweep++)
+  //set all surface blocks to dirt
+  for(int i = SAND_RADIUS; i < SAND_RADIUS + 16; i++)
   {
-    for(int x = 0; x < wx; x++)
+    for(int k = SAND_RADIUS; k < SAND_RADIUS + 16; k++)
     {
-      for(int y = 0; y < wy; y++)
+      //trace down from sky to find highest block
+      for(int j = -y0 + wy - 1; j >= -y0; j--)
       {
-        for(int z = 0; z < wz; z++)
+        if(s.cells[i][j][k] == STONE)
         {
-          //test neighbors around
-          //note: values outside world have value 0
-          //since threshold is 8, dividing sum of neighbor values by 26 and then comparing against same threshold provides smoothing function
-          int neighborVals = 0;
-          int samples = 0;
-          for(int tx = -1; tx <= 1; tx++)
-          {
-            for(int ty = -1; ty <= 1; ty++)
-            {
-              for(int tz = -1; tz <= 1; tz++)
-              {
-                if(blockInBounds(tx, ty, tz))
-                {
-                  neighborVals += getBlock(x + tx, y + ty, z + tz);
-                  samples++;
-                }
-              }
-            }
-          }
-          //get sample value as rounded-to-nearest average of samples
-          //kill tiny floating islands
-          if(samples < 5)
-            neighborVals = 0;
-          neighborVals = (neighborVals + samples / 2) / samples;
-          if(neighborVals >= 8 + rand() % 2)
-            setBlock(13, x, y, z);
-          else
-            setBlock(4, x, y, z);
+          s.cells[i][j][k] = DIRT;
+          break;
         }
       }
     }
   }
-  //now, set each block above a threshold to stone, and each below to air
-  for(int x = 0; x < wx; x++)
+  //set all solid blocks with water in the surrounding 5x5x5 region to sand
+  //(separable: dilate water along z, then y, then x)
+  for(int i = 0; i < valid; i++)
   {
-    for(int y = 0; y < wy; y++)
+    for(int j = 0; j < PAD_H; j++)
     {
-      for(int z = 0; z < wz; z++)
+      for(int k = SAND_RADIUS; k < SAND_RADIUS + 16; k++)
       {
-        int val = getBlock(x, y, z);
-        if(val >= 6)
-        {
-          setBlock(STONE, x, y, z);
-        }
-        else
-          setBlock(AIR, x, y, z);
+        bool w = false;
+        for(int d = -SAND_RADIUS; d <= SAND_RADIUS; d++)
+          w = w || s.cells[i][j][k + d] == WATER;
+        s.waterZ[i][j][k] = w;
       }
     }
   }
-  //set the bottom layer of world to bedrock
-  for(int i = 0; i < wx; i++)
+  for(int i = 0; i < valid; i++)
   {
-    for(int j = 0; j < wz; j++)
+    for(int j = -y0; j < -y0 + wy; j++)
     {
-      setBlock(BEDROCK, i, 0, j);
+      for(int k = SAND_RADIUS; k < SAND_RADIUS + 16; k++)
+      {
+        bool w = false;
+        for(int d = -SAND_RADIUS; d <= SAND_RADIUS; d++)
+          w = w || s.waterZ[i][j + d][k];
+        s.waterZY[i][j][k] = w;
+      }
     }
   }
-  //set all air blocks below sea level to water
-  for(int x = 0; x < wx; x++)
+  for(int i = SAND_RADIUS; i < SAND_RADIUS + 16; i++)
   {
-    for(int y = 0; y < wy / 2; y++)
+    for(int j = -y0; j < -y0 + wy; j++)
     {
-      for(int z = 0; z < wz; z++)
+      for(int k = SAND_RADIUS; k < SAND_RADIUS + 16; k++)
       {
-        if(getBlock(x, y, z) == AIR)
+        Block b = s.cells[i][j][k];
+        if(b != AIR && b != WATER)
         {
-          setBlock(WATER, x, y, z);
+          bool nearWater = false;
+          for(int d = -SAND_RADIUS; d <= SAND_RADIUS; d++)
+            nearWater = nearWater || s.waterZY[i + d][j][k];
+          if(nearWater)
+            b = SAND;
         }
+        int y = y0 + j;
+        chunks[cx][y / 16][cz].blocks[i - SAND_RADIUS][y % 16][k - SAND_RADIUS] = b;
       }
     }
   }
-  //set all surface blocks to dirt
-  for(int x = 0; x < wx; x++)
+}
+
+//replace some stone with ores
+//note: veins attribute is average veins per chunk in the depth range
+struct VeinType
+{
+  Block block;
+  int minSize;
+  int maxSize;
+  //veins are centered below this height
+  int minDepth;
+  float veins;
+};
+
+//configuration:
+static const VeinType veinTypes[] =
+{
+  {QUARTZ, 5, 10, chunksY * 16 / 2, 0.1},
+  {COAL, 3, 6, chunksY * 16, 0.1},
+  {IRON, 2, 4, chunksY * 16 / 2, 0.3},
+  {GOLD, 2, 3, chunksY * 16 / 3, 0.2},
+  {DIAMOND, 1, 3, chunksY * 16 / 5, 0.1}
+};
+
+static void genColumnVeins(int cx, int cz)
+{
+  int wy = chunksY * 16;
+  const int numTypes = sizeof(veinTypes) / sizeof(VeinType);
+  for(int t = 0; t < numTypes; t++)
   {
-    for(int z = 0; z < wz; z++)
+    const VeinType& vt = veinTypes[t];
+    float perColumn = chunksY * vt.veins * ((float) vt.minDepth / wy);
+    //veins are smaller than a chunk, so only veins belonging to this column
+    //and its 8 neighbors can reach into it. Every column visits them in the
+    //same order, so overlapping veins resolve the same way on both sides.
+    for(int ncx = cx - 1; ncx <= cx + 1; ncx++)
     {
-      //trace down from sky to find highest block
-      for(int y = wy - 1; y >= 0; y--)
+      for(int ncz = cz - 1; ncz <= cz + 1; ncz++)
       {
-        Block b = getBlock(x, y, z);
-        if(b == STONE)
+        if(ncx < 0 || ncz < 0 || ncx >= chunksX || ncz >= chunksZ)
+          continue;
+        unsigned state = blockHash(ncx, t, ncz, 100);
+        int count = perColumn + (nextRand(state) % 1000) / 1000.0f;
+        for(int v = 0; v < count; v++)
         {
-          setBlock(DIRT, x, y, z);
-          break;
+          int x = ncx * 16 + nextRand(state) % 16;
+          int y = nextRand(state) % vt.minDepth;
+          int z = ncz * 16 + nextRand(state) % 16;
+          int rx = vt.minSize + nextRand(state) % (vt.maxSize - vt.minSize + 1);
+          int ry = vt.minSize + nextRand(state) % (vt.maxSize - vt.minSize + 1);
+          int rz = vt.minSize + nextRand(state) % (vt.maxSize - vt.minSize + 1);
+          replaceEllipsoid(STONE, vt.block, x, y, z, rx, ry, rz, cx, cz);
         }
       }
     }
   }
-  //set all solid blocks near water to sand
-  for(int x = 0; x < wx; x++)
+}
+
+//try to plant one tree at a random place on the surface of the column
+static void genColumnTree(int cx, int cz)
+{
+  int wy = chunksY * 16;
+  unsigned state = blockHash(cx, 0, cz, 200);
+  //leaves reach at most 3 blocks from the trunk, so this keeps the
+  //whole tree inside the column
+  int x = cx * 16 + 3 + nextRand(state) % 10;
+  int z = cz * 16 + 3 + nextRand(state) % 10;
+  //determine if the highest block here is dirt
+  bool hitDirt = false;
+  int y;
+  for(y = wy - 1; y >= 1; y--)
+  {
+    Block b = getBlock(x, y, z);
+    if(b == DIRT)
+      hitDirt = true;
+    if(b != AIR)
+      break;
+  }
+  if(!hitDirt)
+  {
+    return;
+  }
+  //plant the tree on dirt block @ (x, y, z)
+  int treeHeight = 4 + nextRand(state) % 4;
+  for(int i = 0; i < treeHeight; i++)
+  {
+    setBlock(LOG, x, y + 1 + i, z);
+  }
+  //fill in vertical ellipsoid of leaves around the trunk
+  //cover the top 2/3 of trunk, and extend another 1/3 above it
+  //have x/z radius be half the y radius
+  replaceEllipsoid(AIR, LEAF, x, y + 1 + 0.833 * treeHeight, z, treeHeight * 0.4, treeHeight * 0.5, treeHeight * 0.4, cx, cz);
+}
+
+//Structures span several columns, so each is built once all the columns
+//it may modify have their terrain, and those columns are published after it
+struct Structure
+{
+  void (*build)(int x, int z);
+  int x;
+  int z;
+  //half-extents of the region the builder may modify
+  int rx;
+  int rz;
+  //columns under the structure still being generated
+  atomic_int pending;
+};
+
+#define NUM_STRUCTURES 2
+static Structure structures[NUM_STRUCTURES];
+
+static bool structureTouches(const Structure& s, int cx, int cz)
+{
+  return cx >= (s.x - s.rx) / 16 && cx <= (s.x + s.rx) / 16 &&
+    cz >= (s.z - s.rz) / 16 && cz <= (s.z + s.rz) / 16;
+}
+
+//columns sorted by distance from the focus point
+static vector<int> columnOrder;
+static atomic_int nextColumn;
+static pthread_t terrainThread;
+static bool terrainRunning = false;
+
+static void* terrainWorker(void*)
+{
+  ColumnScratch* scratch = new ColumnScratch;
+  while(true)
   {
-    for(int y = 0; y < wy; y++)
+    int i = atomic_fetch_add(&nextColumn, 1);
+    if(i >= chunksX * chunksZ)
+      break;
+    int cx = columnOrder[i] % chunksX;
+    int cz = columnOrder[i] / chunksX;
+    genColumnTerrain(*scratch, cx, cz);
+    genColumnVeins(cx, cz);
+    genColumnTree(cx, cz);
+    bool underStructure = false;
+    for(int j = 0; j < NUM_STRUCTURES; j++)
     {
-      for(int z = 0; z < wz; z++)
+      Structure& s = structures[j];
+      if(!structureTouches(s, cx, cz))
+        continue;
+      underStructure = true;
+      if(atomic_fetch_sub(&s.pending, 1) == 1)
       {
-        if(getBlock(x, y, z) != AIR && getBlock(x, y, z) != WATER)
-        {
-          //look around a 3x1x3 region for water blocks
-          bool nearWater = false;
-          for(int i = -2; i <= 2; i++)
-          {
-            for(int j = -2; j <= 2; j++)
-            {
-              for(int k = -2; k <= 2; k++)
-              {
-                if(getBlock(x + i, y + j, z + k) == WATER)
-                {
-                  nearWater = true;
-                }
-              }
-            }
-          }
-          if(nearWater)
-          {
-            setBlock(SAND, x, y, z);
-          }
-        }
+        //this was the last column under the structure
+        s.build(s.x, s.z);
+        for(int scx = 0; scx < chunksX; scx++)
+          for(int scz = 0; scz < chunksZ; scz++)
+            if(structureTouches(s, scx, scz))
+              publishColumn(scx, scz);
       }
     }
+    if(!underStructure)
+      publishColumn(cx, cz);
   }
-  //replace some stone with ores
-  //note: veins attribute is average veins per chunk in the depth range
-  //configuration:
-#define GRANITE_MIN_SIZE 6
-#define GRANITE_MAX_SIZE 12
-#define GRANITE_MIN_DEPTH wy
-#define GRANITE_VEINS 0.1
-#define QUARTZ_MIN_SIZE 5
-#define QUARTZ_MAX_SIZE 10
-#define QUARTZ_MIN_DEPTH wy / 2
-#define QUARTZ_VEINS 0.1
-#define COAL_MIN_SIZE 3
-#define COAL_MAX_SIZE 6
-#define COAL_MIN_DEPTH wy
-#define COAL_VEINS 0.1
-#define IRON_MIN_SIZE 2
-#define IRON_MAX_SIZE 4
-#define IRON_MIN_DEPTH wy / 2
-#define IRON_VEINS 0.3
-#define GOLD_MIN_SIZE 2
-#define GOLD_MAX_SIZE 3
-#define GOLD_MIN_DEPTH wy / 3
-#define GOLD_VEINS 0.2
-#define DIAMOND_MIN_SIZE 1
-#define DIAMOND_MAX_SIZE 3
-#define DIAMOND_MIN_DEPTH wy / 5
-#define DIAMOND_VEINS 0.1
-#define GEN_VEINS(block, minsize, maxsize, mindepth, veins) \
-  { \
-    float freq = veins * ((float) mindepth / wy); \
-    for(int v = 0; v < chunksX * chunksY * chunksZ * freq; v++) \
-    { \
-      int x = rand() % wx; \
-      int y = rand() % mindepth; \
-      int z = rand() % wz; \
-      int rx = minsize + rand() % (maxsize - minsize + 1); \
-      int ry = minsize + rand() % (maxsize - minsize + 1); \
-      int rz = minsize + rand() % (maxsize - minsize + 1); \
-      replaceEllipsoid(STONE, block, x, y, z, rx, ry, rz); \
-    } \
-  }
-  GEN_VEINS(QUARTZ, QUARTZ_MIN_SIZE, QUARTZ_MAX_SIZE, QUARTZ_MIN_DEPTH, QUARTZ_VEINS);
-  GEN_VEINS(COAL, COAL_MIN_SIZE, COAL_MAX_SIZE, COAL_MIN_DEPTH, COAL_VEINS);
-  GEN_VEINS(IRON, IRON_MIN_SIZE, IRON_MAX_SIZE, IRON_MIN_DEPTH, IRON_VEINS);
-  GEN_VEINS(GOLD, GOLD_MIN_SIZE, GOLD_MAX_SIZE, GOLD_MIN_DEPTH, GOLD_VEINS);
-  GEN_VEINS(DIAMOND, DIAMOND_MIN_SIZE, DIAMOND_MAX_SIZE, DIAMOND_MIN_DEPTH, DIAMOND_VEINS);
-  //find random places on the surface to plant trees
-  for(int tree = 0; tree < chunksX * chunksZ; tree++)
-  {
-    //determine if the highest block here is dirt
-    int x = rand() % wx;
-    int z = rand() % wz;
-    bool hitDirt = false;
-    int y;
-    for(y = wy - 1; y >= 1; y--)
-    {
-      Block b = getBlock(x, y, z);
-      if(b == DIRT)
-        hitDirt = true;
-      if(b != AIR)
-        break;
-    }
-    if(!hitDirt)
-    {
-      continue;
-    }
-    //try to plant the tree on dirt block @ (x, y, z)
-    int treeHeight = 4 + rand() % 4;
-    for(int i = 0; i < treeHeight; i++)
-    {
-      setBlock(LOG, x, y + 1 + i, z);
-    }
-    //fill in vertical ellipsoid of leaves around the trunk
-    //cover the top 2/3 of trunk, and extend another 1/3 above it
-    //have x/z radius be half the y radius
-    //loop over bounding box of the leaves
-    //float ellY = y + 1 + (5.0 / 6.0) * treeHeight;
-    //int ry = 2 * treeHeight / 3;
-    //float rxz = 2 * ry / 3;
-    replaceEllipsoid(AIR, LEAF, x, y + 1 + 0.833 * treeHeight, z, treeHeight * 0.4, treeHeight * 0.5, treeHeight * 0.4);
-  }
-  createTower(0.25 * (chunksX * 16), 0.25 * (chunksZ * 16));
-  createCastle(0.75 * (chunksX * 16), 0.25 * (chunksZ * 16));
-  setNumFilled();
+  delete scratch;
+  return NULL;
+}
+
+static void* terrainDriver(void*)
+{
+  pthread_t workers[TERRAIN_THREADS];
+  for(int i = 0; i < TERRAIN_THREADS; i++)
+  {
+    pthread_create(workers + i, NULL, terrainWorker, NULL);
+  }
+  for(int i = 0; i < TERRAIN_THREADS; i++)
+  {
+    pthread_join(workers[i], NULL);
+  }
+  cout << "Done with terrain\n";
+  return NULL;
+}
+
+void startTerrainGen(float focusX, float focusZ)
+{
   initLinearWorld();
+  //tower and castle, with the extents createTower/createCastle modify
+  structures[0].build = createTower;
+  structures[0].x = 0.25 * (chunksX * 16);
+  structures[0].z = 0.25 * (chunksZ * 16);
+  structures[0].rx = 16 / 2;
+  structures[0].rz = 12 / 2;
+  structures[1].build = createCastle;
+  structures[1].x = 0.75 * (chunksX * 16);
+  structures[1].z = 0.25 * (chunksZ * 16);
+  structures[1].rx = 21 / 2 + 10;
+  structures[1].rz = 35 / 2 + 10;
+  for(int j = 0; j < NUM_STRUCTURES; j++)
+  {
+    int n = 0;
+    for(int cx = 0; cx < chunksX; cx++)
+      for(int cz = 0; cz < chunksZ; cz++)
+        if(structureTouches(structures[j], cx, cz))
+          n++;
+    atomic_store(&structures[j].pending, n);
+  }
+  columnOrder.resize(chunksX * chunksZ);
+  for(int i = 0; i < chunksX * chunksZ; i++)
+    columnOrder[i] = i;
+  auto focusDist = [=](int c)
+  {
+    float dx = (c % chunksX) * 16 + 8 - focusX;
+    float dz = (c / chunksX) * 16 + 8 - focusZ;
+    return dx * dx + dz * dz;
+  };
+  std::stable_sort(columnOrder.begin(), columnOrder.end(),
+      [&](int a, int b) {return focusDist(a) < focusDist(b);});
+  atomic_store(&nextColumn, 0);
+  terrainRunning = true;
+  pthread_create(&terrainThread, NULL, terrainDriver, NULL);
+}
+
+void waitForTerrain()
+{
+  if(terrainRunning)
+  {
+    pthread_join(terrainThread, NULL);
+    terrainRunning = false;
+  }
+}
+
+void terrainGen()
+{
+  startTerrainGen(chunksX * 16 / 2, chunksZ * 16 / 2);
+  waitForTerrain();
 }
 
 void createTower(int x, int z)
@@ -24,7 +24,14 @@ typedef struct
 #define seaLevel (chunksY * 16 / 2)
 
 void flatGen();
+//Generate the whole world, blocking until it is done
 void terrainGen();
+//Start generating terrain on background threads, one column of chunks at a
+//time, beginning with the columns nearest to (focusX, focusZ). Chunks that
+//aren't ready read as water below sea level and air above in the ray tracer.
+void startTerrainGen(float focusX, float focusZ);
+//Block until background terrain generation is complete
+void waitForTerrain();
 void printWorldComposition();
 
 extern Chunk chunks[chunksX][chunksY][chunksZ];
@@ -36,6 +43,16 @@ void setBlock(Block b, int x, int y, int z);
 Block getBlockFast(int x, int y, int z);
 Block getBlock(int x, int y, int z);
 bool blockInBounds(int x, int y, int z);
+//Has the chunk containing block (x, y, z) been generated?
+bool chunkReady(int x, int y, int z);
+//Block-space box [lo, hi), aligned to chunks, outside of which every block
+//in the world is air
+void occupiedBounds(ivec3& lo, ivec3& hi);
+//Changes whenever blocks the ray tracer can see change (edits to
+//generated chunks, or newly generated chunks)
+int worldVersion();
+//Same, for the blocks of chunk (cx, cy, cz) only
+int chunkVersion(int cx, int cy, int cz);
 
 void createTower(int x, int z);
 void createCastle(int x, int z);